@@ -0,0 +1,56 @@
+# Writes a --record file in which the server answers `complete` with
+# CANDIDATES candidates (50,000 by default), about 4MB of bencode, for
+# `make bench-complete` to replay.  Run with LC_ALL=C so that lengths are
+# in bytes and printf("%c") writes single bytes.
+
+function varint(n)
+{
+    while (n >= 128)
+    {
+        printf "%c", n % 128 + 128
+        n = int(n / 128)
+    }
+    printf "%c", n
+}
+
+function header(direction, size)
+{
+    printf "%s", direction
+    varint(0)
+    varint(0)
+    varint(size)
+}
+
+function record(direction, data)
+{
+    header(direction, length(data))
+    printf "%s", data
+}
+
+function completion(i,    candidate)
+{
+    candidate = "clojure.core/candidate-" i
+    return "d9:candidate" length(candidate) ":" candidate "2:ns12:clojure.core4:type8:functione"
+}
+
+BEGIN {
+    if (!CANDIDATES)
+        CANDIDATES = 50000
+    prefix = "d11:completionsl"
+    suffix = "e6:statusl4:doneee"
+    size = length(prefix) + length(suffix)
+    for (i = 0; i < CANDIDATES; i++)
+        size += length(completion(i))
+
+    printf "REPREC1\n"
+    record(">", "d2:op5:clonee")
+    record("<", "d11:new-session5:bench6:statusl4:doneee")
+    record(">", "d2:op8:completee")
+    header("<", size)
+    printf "%s", prefix
+    for (i = 0; i < CANDIDATES; i++)
+        printf "%s", completion(i)
+    printf "%s", suffix
+    record(">", "d2:op5:closee")
+    record("<", "d6:statusl4:done14:session-closedee")
+}
@@ -1,4 +1,4 @@
-{ stdenv, lib, asciidoc-full }:
+{ stdenv, lib, asciidoc-full, zlib }:
 
 stdenv.mkDerivation rec {
   pname = "rep";
@@ -9,11 +9,14 @@ stdenv.mkDerivation rec {
   nativeBuildInputs = [
     asciidoc-full
   ];
+  buildInputs = [
+    zlib
+  ];
 
   postPatch = ''
-    substituteInPlace rc/rep.kak --replace '$(rep' '$('"$out/bin/rep"
+    substituteInPlace rc/rep.kak --replace "rep_command='rep " "rep_command='$out/bin/rep "
   '';
-  makeFlags = [ "prefix=$(out)" ];
+  makeFlags = [ "prefix=$(out)" "REP_ZLIB=1" ];
 
   meta = with lib; {
     description = "Single-shot nREPL client";
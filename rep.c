@@ -1,9 +1,14 @@
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #if defined(_WIN32) || defined(WIN32)
 #include <malloc.h>
 #include <winsock2.h>
@@ -12,15 +17,36 @@
 #else
 #include <alloca.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#if !defined(REP_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define REP_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <libgen.h>
+#if defined(REP_ZLIB)
+#include <zlib.h>
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 256
@@ -44,6 +70,45 @@ void error(const char* what)
     exit(255);
 }
 
+void write_fully(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && EINTR == errno)
+            continue;
+        if (count <= 0)
+            return;
+        data += count;
+        size -= count;
+    }
+}
+
+long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void sleep_ms(long ms)
+{
+#if defined(_WIN32) || defined(WIN32)
+    Sleep(ms);
+#else
+    struct timespec duration = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+    while (-1 == nanosleep(&duration, &duration) && EINTR == errno)
+        ;
+#endif
+}
+
 char* strdup_up_to(const char* input, char ch)
 {
     char* result = strdup(input);
@@ -53,6 +118,34 @@ char* strdup_up_to(const char* input, char ch)
     return result;
 }
 
+/* Reads the rest of FILE into a NUL-terminated, malloc()ed buffer. */
+char *slurp_stream(FILE* file, size_t* size)
+{
+    size_t allocated = 4096;
+    char* data = (char*)malloc(allocated);
+    *size = 0;
+    size_t count;
+    while ((count = fread(data + *size, 1, allocated - *size - 1, file)) > 0)
+    {
+        *size += count;
+        if (allocated - *size - 1 == 0)
+            data = (char*)realloc(data, allocated <<= 1);
+    }
+    data[*size] = '\0';
+    return data;
+}
+
+/* Reads all of FILENAME into a NUL-terminated, malloc()ed buffer. */
+char *slurp_file(const char* filename, size_t* size)
+{
+    FILE *file = fopen(filename, "rb");
+    if (NULL == file)
+        return NULL;
+    char* data = slurp_stream(file, size);
+    fclose(file);
+    return data;
+}
+
 /* --- bvalue ------------------------------------------------------------- */
 
 enum bvalue_type
@@ -63,6 +156,15 @@ enum bvalue_type
     BVALUE_DICTIONARY
 };
 
+struct bvalue_entry
+{
+    struct bvalue* key;
+    struct bvalue* value;
+};
+
+/* Lists and dictionaries keep their elements in an array allocated in the
+ * same block as the value, sized when decoding finds the end.
+ */
 struct bvalue
 {
     enum bvalue_type type;
@@ -74,13 +176,12 @@ struct bvalue
             char data[1];
         } bsvalue;
         struct {
-            struct bvalue *item;
-            struct bvalue *tail;
+            size_t count;
+            struct bvalue** items;
         } lvalue;
         struct {
-            struct bvalue *key;
-            struct bvalue *value;
-            struct bvalue *tail;
+            size_t count;
+            struct bvalue_entry* entries;
         } dvalue;
     } value;
 };
@@ -112,48 +213,46 @@ struct bvalue* make_bvalue_bytestring(char* bytes, size_t size)
     return result;
 }
 
-struct bvalue* make_bvalue_list(struct bvalue* item, struct bvalue* tail)
+struct bvalue* allocate_bvalue_list(size_t count)
 {
-    struct bvalue* result = (struct bvalue*)malloc(sizeof(struct bvalue));
+    struct bvalue* result = (struct bvalue*)malloc(sizeof(struct bvalue) + count * sizeof(struct bvalue*));
     result->type = BVALUE_LIST;
-    result->value.lvalue.item = item;
-    result->value.lvalue.tail = tail;
+    result->value.lvalue.count = count;
+    result->value.lvalue.items = (struct bvalue**)(result + 1);
     return result;
 }
 
-struct bvalue* make_bvalue_dictionary(struct bvalue* key, struct bvalue* value, struct bvalue* tail)
+struct bvalue* allocate_bvalue_dictionary(size_t count)
 {
-    struct bvalue* result = (struct bvalue*)malloc(sizeof(struct bvalue));
+    struct bvalue* result = (struct bvalue*)malloc(sizeof(struct bvalue) + count * sizeof(struct bvalue_entry));
     result->type = BVALUE_DICTIONARY;
-    result->value.dvalue.key = key;
-    result->value.dvalue.value = value;
-    result->value.dvalue.tail = tail;
+    result->value.dvalue.count = count;
+    result->value.dvalue.entries = (struct bvalue_entry*)(result + 1);
     return result;
 }
 
 void free_bvalue(struct bvalue* value)
 {
-    while (value)
+    if (!value)
+        return;
+    switch (value->type)
     {
-        struct bvalue* next = NULL;
-        switch (value->type)
+    case BVALUE_INTEGER:
+    case BVALUE_BYTESTRING:
+        break;
+    case BVALUE_LIST:
+        for (size_t i = 0; i < value->value.lvalue.count; i++)
+            free_bvalue(value->value.lvalue.items[i]);
+        break;
+    case BVALUE_DICTIONARY:
+        for (size_t i = 0; i < value->value.dvalue.count; i++)
         {
-        case BVALUE_INTEGER:
-        case BVALUE_BYTESTRING:
-            break;
-        case BVALUE_LIST:
-            free_bvalue(value->value.lvalue.item);
-            next = value->value.lvalue.tail;
-            break;
-        case BVALUE_DICTIONARY:
-            free_bvalue(value->value.dvalue.key);
-            free_bvalue(value->value.dvalue.value);
-            next = value->value.dvalue.tail;
-            break;
+            free_bvalue(value->value.dvalue.entries[i].key);
+            free_bvalue(value->value.dvalue.entries[i].value);
         }
-        free(value);
-        value = next;
+        break;
     }
+    free(value);
 }
 
 _Bool bvalue_equals_string(struct bvalue* value, const char* s)
@@ -170,16 +269,16 @@ _Bool bvalue_equals_string(struct bvalue* value, const char* s)
 
 struct bvalue* bvalue_dictionary_get(struct bvalue* dictionary, const char* key)
 {
+    if (!dictionary || BVALUE_DICTIONARY != dictionary->type)
+        return NULL;
     size_t key_length = strlen(key);
-    for ( ; dictionary; dictionary = dictionary->value.dvalue.tail)
+    struct bvalue_entry* entries = dictionary->value.dvalue.entries;
+    for (size_t i = 0; i < dictionary->value.dvalue.count; i++)
     {
-        if (BVALUE_DICTIONARY != dictionary->type)
-            continue;
-        if (!dictionary->value.dvalue.key)
-            continue;
-        if (!bvalue_equals_string(dictionary->value.dvalue.key, key))
-            continue;
-        return dictionary->value.dvalue.value;
+        struct bvalue* candidate = entries[i].key;
+        if (BVALUE_BYTESTRING == candidate->type && key_length == candidate->value.bsvalue.size &&
+            !memcmp(candidate->value.bsvalue.data, key, key_length))
+            return entries[i].value;
     }
     return NULL;
 }
@@ -190,8 +289,8 @@ _Bool bvalue_list_contains_string(struct bvalue* list, const char* s)
         return false;
     if (BVALUE_LIST != list->type)
         return false;
-    for (; list; list = list->value.lvalue.tail)
-        if (bvalue_equals_string(list->value.lvalue.item, s))
+    for (size_t i = 0; i < list->value.lvalue.count; i++)
+        if (bvalue_equals_string(list->value.lvalue.items[i], s))
             return true;
     return false;
 }
@@ -234,17 +333,74 @@ void bvalue_append_string(struct bvalue** value, const char* bytes, size_t lengt
     }
 }
 
-void bvalue_append_bvalue(struct bvalue** targetp, struct bvalue* value)
+/* With --quote, each value substituted into a format is wrapped and escaped
+ * so that a program such as an editor can use the output as it is.
+ */
+struct quoting
+{
+    const char* name;
+    const char* open;
+    const char* close;
+    char special;
+    const char* escaped;
+};
+
+const struct quoting QUOTINGS[] =
+{
+    { "none",    "",  "",  '\0', NULL },
+    { "kakoune", "'", "'", '\'', "''" },
+    { "shell",   "'", "'", '\'', "'\\''" },
+    { NULL,      NULL, NULL, '\0', NULL }
+};
+
+const struct quoting* find_quoting(const char* name)
+{
+    for (const struct quoting* quoting = QUOTINGS; quoting->name; quoting++)
+        if (!strcmp(quoting->name, name))
+            return quoting;
+    return NULL;
+}
+
+void bvalue_append_escaped(struct bvalue** targetp, const struct quoting* quoting, const char* bytes, size_t length)
+{
+    if (NULL == quoting->escaped)
+    {
+        bvalue_append_string(targetp, bytes, length);
+        return;
+    }
+    const char* end = bytes + length;
+    for (const char* p = bytes; p < end; )
+    {
+        const char* special = (const char*)memchr(p, quoting->special, end - p);
+        if (NULL == special)
+        {
+            bvalue_append_string(targetp, p, end - p);
+            break;
+        }
+        bvalue_append_string(targetp, p, special - p);
+        bvalue_append_string(targetp, quoting->escaped, strlen(quoting->escaped));
+        p = special + 1;
+    }
+}
+
+void bvalue_append_quoted(struct bvalue** targetp, const struct quoting* quoting, const char* bytes, size_t length)
+{
+    bvalue_append_string(targetp, quoting->open, strlen(quoting->open));
+    bvalue_append_escaped(targetp, quoting, bytes, length);
+    bvalue_append_string(targetp, quoting->close, strlen(quoting->close));
+}
+
+void bvalue_append_bvalue(struct bvalue** targetp, struct bvalue* value, const struct quoting* quoting)
 {
     char ivalue[64];
     switch (value->type)
     {
     case BVALUE_INTEGER:
         sprintf(ivalue, "%d", value->value.ivalue);
-        bvalue_append_string(targetp, ivalue, strlen(ivalue));
+        bvalue_append_quoted(targetp, quoting, ivalue, strlen(ivalue));
         break;
     case BVALUE_BYTESTRING:
-        bvalue_append_string(targetp, value->value.bsvalue.data, value->value.bsvalue.size);
+        bvalue_append_quoted(targetp, quoting, value->value.bsvalue.data, value->value.bsvalue.size);
         break;
     case BVALUE_LIST:
     case BVALUE_DICTIONARY:
@@ -256,7 +412,7 @@ void bvalue_append_bvalue(struct bvalue** targetp, struct bvalue* value)
 const char PERCENT = '%';
 const char NEWLINE = '\n';
 
-void bvalue_append_format(struct bvalue** targetp, struct bvalue* value, const char* format)
+void bvalue_append_format(struct bvalue** targetp, struct bvalue* value, const char* format, const struct quoting* quoting)
 {
     for (const char* p = format; *p; p++)
     {
@@ -277,7 +433,7 @@ void bvalue_append_format(struct bvalue** targetp, struct bvalue* value, const c
             break;
         case '.':
             p++;
-            bvalue_append_bvalue(targetp, value);
+            bvalue_append_bvalue(targetp, value, quoting);
             break;
         case '{':
             p += 2;
@@ -302,11 +458,11 @@ void bvalue_append_format(struct bvalue** targetp, struct bvalue* value, const c
             {
                 if (BVALUE_LIST == embed->type)
                 {
-                    for (struct bvalue* i = embed; i; i = i->value.lvalue.tail)
-                        bvalue_append_format(targetp, i->value.lvalue.item, element_pattern);
+                    for (size_t i = 0; i < embed->value.lvalue.count; i++)
+                        bvalue_append_format(targetp, embed->value.lvalue.items[i], element_pattern, quoting);
                 }
                 else
-                    bvalue_append_bvalue(targetp, embed);
+                    bvalue_append_bvalue(targetp, embed, quoting);
             }
             free(element_pattern);
             p = end;
@@ -317,66 +473,154 @@ void bvalue_append_format(struct bvalue** targetp, struct bvalue* value, const c
     }
 }
 
-struct bvalue* bvalue_format(struct bvalue* value, const char* format)
+struct bvalue* bvalue_format(struct bvalue* value, const char* format, const struct quoting* quoting)
 {
     struct bvalue* result = allocate_bvalue_bytestring(128);
-    bvalue_append_format(&result, value, format);
+    bvalue_append_format(&result, value, format, quoting);
     return result;
 }
 
 
-void bvalue_dump(struct bvalue* value, const char* prefix)
+/* Appends a readable rendering of VALUE, for -v, indenting nested lines
+ * with PREFIX.
+ */
+void bvalue_append_dump(struct bvalue** targetp, struct bvalue* value, const char* prefix)
 {
     switch (value->type)
     {
     case BVALUE_BYTESTRING:
-        printf("\"%s\"", value->value.bsvalue.data);
+        bvalue_append_string(targetp, "\"", 1);
+        bvalue_append_string(targetp, value->value.bsvalue.data, strlen(value->value.bsvalue.data));
+        bvalue_append_string(targetp, "\"", 1);
         break;
     case BVALUE_INTEGER:
-        printf("%d", value->value.ivalue);
+        {
+            char number[32];
+            sprintf(number, "%d", value->value.ivalue);
+            bvalue_append_string(targetp, number, strlen(number));
+        }
         break;
     case BVALUE_DICTIONARY:
         {
-            printf("{");
+            bvalue_append_string(targetp, "{", 1);
             char *new_prefix = (char*)malloc(strlen(prefix)+3);
             strcpy(new_prefix, prefix);
             strcat(new_prefix, "  ");
-            for (struct bvalue* iterator = value; iterator; iterator = iterator->value.dvalue.tail)
+            for (size_t i = 0; i < value->value.dvalue.count; i++)
             {
-                printf("\n%s", new_prefix);
-                bvalue_dump(iterator->value.dvalue.key, new_prefix);
-                printf(": ");
-                bvalue_dump(iterator->value.dvalue.value, new_prefix);
+                bvalue_append_string(targetp, "\n", 1);
+                bvalue_append_string(targetp, new_prefix, strlen(new_prefix));
+                bvalue_append_dump(targetp, value->value.dvalue.entries[i].key, new_prefix);
+                bvalue_append_string(targetp, ": ", 2);
+                bvalue_append_dump(targetp, value->value.dvalue.entries[i].value, new_prefix);
             }
             free(new_prefix);
-            printf("\n%s}", prefix);
+            bvalue_append_string(targetp, "\n", 1);
+            bvalue_append_string(targetp, prefix, strlen(prefix));
+            bvalue_append_string(targetp, "}", 1);
         }
         break;
     case BVALUE_LIST:
         {
-            printf("[");
+            bvalue_append_string(targetp, "[", 1);
             char *new_prefix = (char*)malloc(strlen(prefix)+3);
             strcpy(new_prefix, prefix);
             strcat(new_prefix, "  ");
-            for (struct bvalue* iterator = value; iterator; iterator = iterator->value.lvalue.tail)
+            for (size_t i = 0; i < value->value.lvalue.count; i++)
             {
-                printf("\n%s", new_prefix);
-                bvalue_dump(iterator->value.lvalue.item, new_prefix);
+                bvalue_append_string(targetp, "\n", 1);
+                bvalue_append_string(targetp, new_prefix, strlen(new_prefix));
+                bvalue_append_dump(targetp, value->value.lvalue.items[i], new_prefix);
             }
             free(new_prefix);
-            printf("\n%s]", prefix);
+            bvalue_append_string(targetp, "\n", 1);
+            bvalue_append_string(targetp, prefix, strlen(prefix));
+            bvalue_append_string(targetp, "]", 1);
         }
         break;
     }
 }
 
 
+/* --- recording ---------------------------------------------------------- */
+
+/* --record appends everything sent and received to a file as a sequence of
+ * records: a direction byte ('>' sent, '<' received), then the connection
+ * number, the microseconds since the previous record, and the length as
+ * LEB128 varints, then the raw bytes.  Each run of rep appends the magic
+ * line and then its records, so a file can hold many runs.  --replay plays
+ * the server's side of the last run back over a socketpair.
+ */
+
+const char RECORDING_MAGIC[] = "REPREC1\n";
+
+struct recording
+{
+    FILE* file;
+    long long last_us;
+    int users;
+};
+
+void recording_put_varint(FILE* file, unsigned long long value)
+{
+    do
+    {
+        int byte = value & 0x7f;
+        value >>= 7;
+        putc(value ? byte | 0x80 : byte, file);
+    }
+    while (value);
+}
+
+struct recording* make_recording(const char* path)
+{
+    struct recording* recording = (struct recording*)malloc(sizeof(struct recording));
+    recording->file = fopen(path, "ab");
+    if (NULL == recording->file)
+        error(path);
+    setvbuf(recording->file, NULL, _IOFBF, 65536);
+    fputs(RECORDING_MAGIC, recording->file);
+    recording->last_us = now_us();
+    recording->users = 0;
+    return recording;
+}
+
+void free_recording(struct recording* recording)
+{
+    fclose(recording->file);
+    free(recording);
+}
+
+void recording_write(struct recording* recording, char direction, int connection, const char* data, size_t size)
+{
+    if (!recording || 0 == size)
+        return;
+    long long now = now_us();
+    putc(direction, recording->file);
+    recording_put_varint(recording->file, connection);
+    recording_put_varint(recording->file, now - recording->last_us);
+    recording_put_varint(recording->file, size);
+    fwrite(data, 1, size, recording->file);
+    recording->last_us = now;
+}
+
 /* --- breader ------------------------------------------------------------ */
 
 struct breader
 {
     int fd;
-    int peeked_char;
+    struct recording* recording;
+    int connection;
+    char* buffer;
+    size_t start;
+    size_t end;
+    size_t allocated;
+    struct bvalue** stack;
+    size_t stack_size;
+    size_t stack_allocated;
+    size_t scan_start;
+    size_t scan_position;
+    int scan_depth;
 };
 
 struct bvalue* breader_read(struct breader* reader);
@@ -385,68 +629,243 @@ struct breader* make_breader(int fd)
 {
     struct breader* reader = (struct breader*)malloc(sizeof(struct breader));
     reader->fd = fd;
-    reader->peeked_char = EOF;
+    reader->recording = NULL;
+    reader->connection = 0;
+    reader->allocated = 65536;
+    reader->buffer = (char*)malloc(reader->allocated);
+    reader->start = 0;
+    reader->end = 0;
+    reader->stack = NULL;
+    reader->stack_size = 0;
+    reader->stack_allocated = 0;
+    reader->scan_start = 0;
+    reader->scan_position = 0;
+    reader->scan_depth = 0;
     return reader;
 }
 
 void free_breader(struct breader* reader)
 {
+    free(reader->buffer);
+    free(reader->stack);
     free(reader);
 }
 
-int bread_next_char(struct breader* reader)
+/* Returns where the next bytes received should go, making room if needed.
+ * The buffer does not move until the next call.
+ */
+char* breader_reserve(struct breader* reader, size_t* space)
 {
-    if (EOF != reader->peeked_char)
+    if (reader->start == reader->end)
     {
-        int result = reader->peeked_char;
-        reader->peeked_char = EOF;
-        return result;
+        reader->start = reader->end = 0;
+        reader->scan_start = reader->scan_position = reader->scan_depth = 0;
     }
-    char ch = 0;
-    int count = recv(reader->fd, &ch, 1, 0);
-    if (count < 0)
-        error("recv");
-    if (0 == count)
-        return EOF;
-    return ch;
+    if (reader->end == reader->allocated)
+    {
+        if (reader->start > 0)
+        {
+            /* An unfinished scan stays valid, since it is relative to start. */
+            if (reader->scan_start != reader->start)
+                reader->scan_position = reader->scan_depth = 0;
+            reader->scan_start = 0;
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        else
+            reader->buffer = (char*)realloc(reader->buffer, reader->allocated <<= 1);
+    }
+    *space = reader->allocated - reader->end;
+    return reader->buffer + reader->end;
+}
+
+/* Adds COUNT bytes received at the place returned by breader_reserve(). */
+void breader_commit(struct breader* reader, size_t count)
+{
+    recording_write(reader->recording, '<', reader->connection, reader->buffer + reader->end, count);
+    reader->end += count;
+}
+
+void breader_append(struct breader* reader, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t space;
+        char* p = breader_reserve(reader, &space);
+        size_t count = size < space ? size : space;
+        memcpy(p, data, count);
+        breader_commit(reader, count);
+        data += count;
+        size -= count;
+    }
+}
+
+/* Receives whatever is available into the buffer.  Returns the number of
+ * bytes received, zero at EOF, or -1 with errno set.
+ */
+ssize_t breader_fill(struct breader* reader)
+{
+    size_t space;
+    char* p = breader_reserve(reader, &space);
+    ssize_t count;
+    while ((count = recv(reader->fd, p, space, 0)) < 0 && EINTR == errno)
+        ;
+    if (count > 0)
+        breader_commit(reader, count);
+    return count;
+}
+
+/* Returns the length of the complete bencoded value at the start of DATA,
+ * or zero if more input is needed.  In that case, *POSITION and *DEPTH are
+ * left at the start of the incomplete token, so that the scan can resume
+ * there when more data arrives.
+ */
+size_t bvalue_scan_from(const char* data, size_t size, size_t* resume_position, int* resume_depth)
+{
+    size_t position = *resume_position;
+    int depth = *resume_depth;
+    do
+    {
+        *resume_position = position;
+        *resume_depth = depth;
+        if (position >= size)
+            return 0;
+        switch (data[position])
+        {
+        case 'd':
+        case 'l':
+            depth++;
+            position++;
+            break;
+        case 'e':
+            if (0 == depth)
+                fail("bad character in nREPL stream");
+            depth--;
+            position++;
+            break;
+        case 'i':
+            {
+                const char* end = (const char*)memchr(data + position, 'e', size - position);
+                if (!end)
+                    return 0;
+                position = end - data + 1;
+            }
+            break;
+        default:
+            {
+                if (!isdigit((unsigned char)data[position]))
+                    fail("bad character in nREPL stream");
+                size_t length = 0;
+                while (position < size && isdigit((unsigned char)data[position]))
+                    length = length * 10 + (data[position++] - '0');
+                if (position >= size)
+                    return 0;
+                if (':' != data[position])
+                    fail("bad character in nREPL stream");
+                position += 1 + length;
+                if (position > size)
+                    return 0;
+            }
+            break;
+        }
+    }
+    while (depth > 0);
+    return position;
+}
+
+size_t bvalue_scan(const char* data, size_t size)
+{
+    size_t position = 0;
+    int depth = 0;
+    return bvalue_scan_from(data, size, &position, &depth);
+}
+
+/* True if a whole value has been received, so breader_read() won't block.
+ * A large reply arrives in many pieces, so scanning resumes where it left
+ * off rather than starting over each time.
+ */
+_Bool breader_has_value(struct breader* reader)
+{
+    if (reader->scan_start != reader->start)
+    {
+        reader->scan_start = reader->start;
+        reader->scan_position = 0;
+        reader->scan_depth = 0;
+    }
+    return bvalue_scan_from(reader->buffer + reader->start, reader->end - reader->start,
+        &reader->scan_position, &reader->scan_depth) > 0;
 }
 
 int bread_peek_char(struct breader* reader)
 {
-    if (EOF == reader->peeked_char)
-        reader->peeked_char = bread_next_char(reader);
-    return reader->peeked_char;
+    if (reader->start == reader->end)
+    {
+        if (reader->fd < 0)
+            return EOF;
+        ssize_t count = breader_fill(reader);
+        if (count < 0)
+            error("recv");
+        if (0 == count)
+            return EOF;
+    }
+    return (unsigned char)reader->buffer[reader->start];
 }
 
-struct bvalue* bread_dictionary(struct breader* reader)
+int bread_next_char(struct breader* reader)
+{
+    int ch = bread_peek_char(reader);
+    if (EOF != ch)
+        reader->start++;
+    return ch;
+}
+
+/* Elements of the lists and dictionaries being decoded are kept on a stack
+ * until the end of their container is reached, when they are copied to
+ * an array of the right size.
+ */
+void breader_push(struct breader* reader, struct bvalue* value)
 {
-    struct bvalue* result = NULL;
-    struct bvalue** iterator = &result;
+    if (reader->stack_size == reader->stack_allocated)
+    {
+        reader->stack_allocated = reader->stack_allocated ? reader->stack_allocated * 2 : 64;
+        reader->stack = (struct bvalue**)realloc(reader->stack, reader->stack_allocated * sizeof(struct bvalue*));
+    }
+    reader->stack[reader->stack_size++] = value;
+}
 
+struct bvalue* bread_dictionary(struct breader* reader)
+{
+    size_t base = reader->stack_size;
     bread_next_char(reader);
     while('e' != bread_peek_char(reader))
     {
-        struct bvalue* key = breader_read(reader);
-        struct bvalue* value = breader_read(reader);
-        *iterator = make_bvalue_dictionary(key, value, NULL);
-        iterator = &(*iterator)->value.dvalue.tail;
+        breader_push(reader, breader_read(reader));
+        breader_push(reader, breader_read(reader));
     }
     bread_next_char(reader);
+
+    struct bvalue* result = allocate_bvalue_dictionary((reader->stack_size - base) / 2);
+    for (size_t i = 0; i < result->value.dvalue.count; i++)
+    {
+        result->value.dvalue.entries[i].key = reader->stack[base + 2 * i];
+        result->value.dvalue.entries[i].value = reader->stack[base + 2 * i + 1];
+    }
+    reader->stack_size = base;
     return result;
 }
 
 struct bvalue* bread_list(struct breader* reader)
 {
-    struct bvalue* result = NULL;
-    struct bvalue** iterator = &result;
+    size_t base = reader->stack_size;
     bread_next_char(reader);
     while('e' != bread_peek_char(reader))
-    {
-        struct bvalue* item = breader_read(reader);
-        *iterator = make_bvalue_list(item, NULL);
-        iterator = &(*iterator)->value.lvalue.tail;
-    }
+        breader_push(reader, breader_read(reader));
     bread_next_char(reader);
+
+    struct bvalue* result = allocate_bvalue_list(reader->stack_size - base);
+    memcpy(result->value.lvalue.items, reader->stack + base, result->value.lvalue.count * sizeof(struct bvalue*));
+    reader->stack_size = base;
     return result;
 }
 
@@ -472,19 +891,28 @@ struct bvalue* bread_integer(struct breader* reader)
 struct bvalue* bread_bytestring(struct breader* reader)
 {
     size_t length = 0;
-    char *bytes = NULL;
     while (':' != bread_peek_char(reader))
-        length = length*10 + (bread_next_char(reader) - '0');
+    {
+        int ch = bread_next_char(reader);
+        if (!isdigit(ch))
+            fail("bad character in nREPL stream");
+        length = length*10 + (ch - '0');
+    }
     bread_next_char(reader);
-    
-    bytes = (char*)malloc(length + 1);
-    if (NULL == bytes)
-        error("malloc");
-    for (size_t i = 0; i < length; i++)
-        bytes[i] = bread_next_char(reader);
-    bytes[length] = '\0';
-    struct bvalue* result = make_bvalue_bytestring(bytes, length);
-    free(bytes);
+
+    struct bvalue* result = allocate_bvalue_bytestring(length);
+    while (result->value.bsvalue.size < length)
+    {
+        if (EOF == bread_peek_char(reader))
+            fail("Unexpected EOF");
+        size_t count = reader->end - reader->start;
+        if (count > length - result->value.bsvalue.size)
+            count = length - result->value.bsvalue.size;
+        memcpy(result->value.bsvalue.data + result->value.bsvalue.size, reader->buffer + reader->start, count);
+        result->value.bsvalue.size += count;
+        reader->start += count;
+    }
+    result->value.bsvalue.data[length] = '\0';
     return result;
 }
 
@@ -509,599 +937,5460 @@ struct bvalue* breader_read(struct breader* reader)
     return NULL;
 }
 
-/* -- print option -------------------------------------------------------- */
+/* --- replay ------------------------------------------------------------- */
 
-struct print_option
+#if !defined(_WIN32) && !defined(WIN32)
+
+struct replay_record
 {
-    struct print_option* next;
-    char* key;
+    char direction;
+    int connection;
+    long long at_us;
+    size_t size;
+    const char* data;
+};
+
+struct replay
+{
+    char* contents;
+    int count;
+    struct replay_record* records;
+    _Bool fast;
+};
+
+struct replay_stream
+{
+    struct replay* replay;
+    int connection;
     int fd;
-    char* format;
 };
 
-struct print_option* make_print_option(const char* optarg)
+_Bool replay_get_varint(const char** p, const char* end, unsigned long long* value)
 {
-    struct print_option* print = (struct print_option*)malloc(sizeof(struct print_option));
-    memset(print, 0, sizeof(struct print_option));
-    print->next = NULL;
-    print->fd = 1;
-    if (!strchr(optarg, ','))
-    {
-        print->key = strdup(optarg);
-        print->format = (char*)malloc(strlen(optarg) + 4);
-        sprintf(print->format, "%%{%s}", optarg);
-    }
-    else
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
     {
-        print->key = strdup_up_to(optarg, ',');
-        const char* p = strchr(optarg, ',') + 1;
-        print->fd = atoi(p);
-        p = strchr(p, ',');
-        if (NULL == p)
-            options_fail("--print option is either KEY or KEY,FD,FORMAT");
-        ++p;
-        print->format = strdup(p);
+        unsigned char byte = *(*p)++;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
     }
-    return print;
+    return false;
 }
 
-void free_print_options(struct print_option* print)
+struct replay* load_replay(const char* path, _Bool fast)
 {
-    while (print)
+    struct replay* replay = (struct replay*)malloc(sizeof(struct replay));
+    memset(replay, 0, sizeof(struct replay));
+    replay->fast = fast;
+    size_t size = 0;
+    replay->contents = slurp_file(path, &size);
+    if (NULL == replay->contents)
+        error(path);
+    size_t magic_length = strlen(RECORDING_MAGIC);
+    if (size < magic_length || memcmp(replay->contents, RECORDING_MAGIC, magic_length))
+        fail("rep: not a recording made by --record");
+
+    long long at_us = 0;
+    const char* end = replay->contents + size;
+    for (const char* p = replay->contents + magic_length; p < end; )
     {
-        if (print->key)
-            free(print->key);
-        if (print->format)
-            free(print->format);
-        void* p = print;
-        print = print->next;
-        free(p);
+        /* A later run starts over. */
+        if ((size_t)(end - p) >= magic_length && !memcmp(p, RECORDING_MAGIC, magic_length))
+        {
+            p += magic_length;
+            replay->count = 0;
+            at_us = 0;
+            continue;
+        }
+        struct replay_record record;
+        unsigned long long connection, delta, length;
+        record.direction = *p++;
+        if (!replay_get_varint(&p, end, &connection) ||
+            !replay_get_varint(&p, end, &delta) ||
+            !replay_get_varint(&p, end, &length) ||
+            length > (size_t)(end - p) ||
+            ('<' != record.direction && '>' != record.direction))
+            fail("rep: recording is truncated or corrupt");
+        at_us += delta;
+        record.connection = (int)connection;
+        record.at_us = at_us;
+        record.size = length;
+        record.data = p;
+        p += length;
+        replay->records = (struct replay_record*)realloc(replay->records, (replay->count + 1) * sizeof(struct replay_record));
+        replay->records[replay->count++] = record;
     }
+    return replay;
 }
 
-void append_print_option(struct print_option** options, struct print_option* new)
-{
-    while (*options)
-        options = &(*options)->next;
-    *options = new;
-}
-
-void remove_print_option(struct print_option** options, const char* key)
+/* Plays the server for one connection.  Before each reply, waits for the
+ * client to have sent as many requests as it had at that point in the
+ * recording, so the client's requests need not be byte-for-byte the same.
+ * Replies are sent at their original times relative to the start of the
+ * connection, or immediately when fast.
+ */
+void* replay_serve(void* arg)
 {
-    while (*options)
+    struct replay_stream* stream = (struct replay_stream*)arg;
+    struct replay* replay = stream->replay;
+    struct breader* client = make_breader(stream->fd);
+    struct bvalue* recorded = allocate_bvalue_bytestring(4096);
+    size_t recorded_scanned = 0;
+    int recorded_requests = 0;
+    int client_requests = 0;
+    long long started_us = now_us();
+    long long first_us = -1;
+    for (int i = 0; i < replay->count; i++)
     {
-        if (!strcmp((*options)->key, key))
+        struct replay_record* record = &replay->records[i];
+        if (record->connection != stream->connection)
+            continue;
+        if (first_us < 0)
+            first_us = record->at_us;
+        if ('>' == record->direction)
         {
-            struct print_option* dead = *options;
-            *options = (*options)->next;
-            dead->next = NULL;
-            free_print_options(dead);
+            bvalue_append_string(&recorded, record->data, record->size);
+            size_t length;
+            while ((length = bvalue_scan(recorded->value.bsvalue.data + recorded_scanned, recorded->value.bsvalue.size - recorded_scanned)) > 0)
+            {
+                recorded_scanned += length;
+                recorded_requests++;
+            }
+            continue;
         }
-        else
-            options = &(*options)->next;
+        while (client_requests < recorded_requests)
+        {
+            size_t length = bvalue_scan(client->buffer + client->start, client->end - client->start);
+            if (length > 0)
+            {
+                client->start += length;
+                client_requests++;
+            }
+            else if (breader_fill(client) <= 0)
+                goto done;
+        }
+        if (!replay->fast)
+        {
+            long long delay_us = (record->at_us - first_us) - (now_us() - started_us);
+            if (delay_us > 0)
+                sleep_ms((long)((delay_us + 999) / 1000));
+        }
+        if (send(stream->fd, record->data, record->size, MSG_NOSIGNAL) != (ssize_t)record->size)
+            goto done;
     }
+    /* Let the client finish reading before we hang up. */
+    while (breader_fill(client) > 0)
+        client->start = client->end;
+done:
+    free_bvalue(recorded);
+    free_breader(client);
+    close(stream->fd);
+    free(stream);
+    return NULL;
 }
 
-struct print_option* make_default_print_options(void)
+/* Returns a socket connected to a replay of CONNECTION's server. */
+int replay_connect(struct replay* replay, int connection)
 {
-    struct print_option* result = make_print_option("out,1,%{out}");
-    append_print_option(&result, make_print_option("err,2,%{err}"));
-    append_print_option(&result, make_print_option("value,1,%{value}%n"));
-    return result;
+    int fds[2];
+    if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        error("socketpair");
+    struct replay_stream* stream = (struct replay_stream*)malloc(sizeof(struct replay_stream));
+    stream->replay = replay;
+    stream->connection = connection;
+    stream->fd = fds[1];
+    pthread_t thread;
+    if (0 != pthread_create(&thread, NULL, replay_serve, stream))
+        fail("rep: unable to start replay thread");
+    pthread_detach(thread);
+    return fds[0];
 }
 
-/* -- options ------------------------------------------------------------- */
+#endif
 
-struct options
+/* --- form reader -------------------------------------------------------- */
+
+/* Just enough of a Clojure reader to find `ns` forms and what they require.
+ * Anything it does not understand is read as a token.  Reader conditionals
+ * read the branch for FEATURE (":clj" if NULL), else the :default branch.
+ */
+
+enum form_type
 {
-    char* port;
-    char* namespace;
-    char* op;
-    char* code;
-    char* filename;
-    int line;
-    int column;
-    char* send;
-    _Bool help;
-    struct print_option* print;
-    _Bool verbose;
-    char* session_init;
+    FORM_LIST,
+    FORM_VECTOR,
+    FORM_MAP,
+    FORM_SET,
+    FORM_STRING,
+    FORM_TOKEN
 };
 
-struct sockaddr_in options_address(struct options* options, const char* port);
+struct form
+{
+    enum form_type type;
+    char* text;
+    int count;
+    struct form** items;
+};
 
-char *read_file(const char* filename, char* buffer, size_t buffer_size)
+struct form_reader
 {
-    FILE *portfile = fopen(filename, "r");
-    if (NULL == portfile)
-        return NULL;
-    if (NULL == fgets(buffer, buffer_size, portfile))
+    const char* p;
+    const char* end;
+    const char* feature;
+    _Bool splice;
+};
+
+struct form* form_read(struct form_reader* reader);
+
+void free_form(struct form* form)
+{
+    if (!form)
+        return;
+    for (int i = 0; i < form->count; i++)
+        free_form(form->items[i]);
+    free(form->items);
+    free(form->text);
+    free(form);
+}
+
+struct form* make_form(enum form_type type, const char* text, size_t length)
+{
+    struct form* form = (struct form*)malloc(sizeof(struct form));
+    form->type = type;
+    form->text = NULL;
+    if (text)
     {
-        fclose(portfile);
-        return NULL;
+        form->text = (char*)malloc(length + 1);
+        memcpy(form->text, text, length);
+        form->text[length] = '\0';
     }
-    fclose(portfile);
-    return buffer;
+    form->count = 0;
+    form->items = NULL;
+    return form;
 }
 
-struct sockaddr_in options_address_from_file(struct options* options, const char* filename)
+void form_append(struct form* form, struct form* item)
 {
-    char linebuffer[256];
-    if (!read_file(filename, linebuffer, sizeof(linebuffer)))
-        error(filename);
-    return options_address(options, linebuffer);
+    form->items = (struct form**)realloc(form->items, (form->count + 1) * sizeof(struct form*));
+    form->items[form->count++] = item;
 }
 
-struct sockaddr_in options_address_from_relative_file(struct options* options, const char* directory_in, const char* filename)
+_Bool form_is_token(struct form* form, const char* text)
 {
-    char *directory = strdup(directory_in);
-    for (;;)
+    return form && FORM_TOKEN == form->type && !strcmp(form->text, text);
+}
+
+_Bool form_delimiter(int ch)
+{
+    return isspace(ch) || strchr("()[]{}\",;", ch);
+}
+
+void form_skip_whitespace(struct form_reader* reader)
+{
+    while (reader->p < reader->end)
     {
-#if defined(_WIN32) || defined(WIN32)
-        struct _stat statb;
-#else
-        struct stat statb;
-#endif
-        char* path_to_check = (char*)malloc(strlen(directory) + strlen(filename) + 2);
-        sprintf(path_to_check, "%s/%s", directory, filename);
-#if defined(_WIN32) || defined(WIN32)
-        if (0 == _stat(path_to_check, &statb))
-#else
-        if (0 == stat(path_to_check, &statb))
-#endif
+        if (isspace((unsigned char)*reader->p) || ',' == *reader->p)
+            reader->p++;
+        else if (';' == *reader->p || (reader->end - reader->p > 1 && !memcmp(reader->p, "#!", 2)))
         {
-            struct sockaddr_in result = options_address_from_file(options, path_to_check);
-            free(path_to_check);
-            free(directory);
-            return result;
+            while (reader->p < reader->end && '\n' != *reader->p)
+                reader->p++;
         }
-        free(path_to_check);
-
-        char* old_directory = strdup(directory);
-        char* parent_directory = dirname(directory);
-        if (!strcmp(old_directory, parent_directory))
+        else if (reader->end - reader->p > 1 && !memcmp(reader->p, "#_", 2))
         {
-            char error_message[PATH_MAX + 128];
-            sprintf(error_message, "rep: No ancestor of %s contains %s", directory_in, filename);
-            fail(error_message);
+            reader->p += 2;
+            free_form(form_read(reader));
         }
-        free(old_directory);
-        char* new_directory = strdup(parent_directory);
-        free(directory);
-        directory = new_directory;
+        else
+            break;
     }
 }
 
-char* make_path_absolute(const char* path)
+struct form* form_read_token(struct form_reader* reader)
 {
-    if (*path == '/')
-        return strdup(path);
-    char* absolute_directory = (char*)malloc(strlen(path) + PATH_MAX + 2);
-    if (NULL == getcwd(absolute_directory, PATH_MAX))
-        error("getcwd");
-    strcat(absolute_directory, "/");
-    strcat(absolute_directory, path);
-    return absolute_directory;
+    const char* start = reader->p;
+    /* A character literal may be a delimiter, as in \( or \space. */
+    if ('\\' == *reader->p && reader->p + 1 < reader->end)
+        reader->p += 2;
+    while (reader->p < reader->end && !form_delimiter((unsigned char)*reader->p))
+        reader->p++;
+    return make_form(FORM_TOKEN, start, reader->p - start);
 }
 
-struct sockaddr_in options_address(struct options* options, const char* port)
+struct form* form_read_string(struct form_reader* reader)
 {
-    if (*port == '@' && !strchr(port + 1, '@'))
-        return options_address_from_file(options, port + 1);
-    else if (*port == '@')
+    const char* start = ++reader->p;
+    while (reader->p < reader->end && '"' != *reader->p)
     {
-        const char* relative_directory = strchr(port + 1, '@') + 1;
-        char* absolute_directory = make_path_absolute(relative_directory);
-        char* filename = strdup_up_to(port + 1, '@');
-        struct sockaddr_in result = options_address_from_relative_file(options, absolute_directory, filename);
-        free(absolute_directory);
-        free(filename);
-        return result;
+        if ('\\' == *reader->p)
+            reader->p++;
+        reader->p++;
     }
-    struct sockaddr_in address =
+    struct form* form = make_form(FORM_STRING, start, reader->p - start);
+    if (reader->p < reader->end)
+        reader->p++;
+    return form;
+}
+
+struct form* form_read_collection(struct form_reader* reader, enum form_type type, char close)
+{
+    struct form* form = make_form(type, NULL, 0);
+    for (;;)
     {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
-        .sin_port = 0,
-    };
-    if (strchr(port, ':'))
+        form_skip_whitespace(reader);
+        if (reader->p >= reader->end)
+            break;
+        if (close == *reader->p)
+        {
+            reader->p++;
+            break;
+        }
+        struct form* item = form_read(reader);
+        if (!item && reader->p < reader->end && close == *reader->p)
+            continue;
+        if (!item)
+            break;
+        if (reader->splice)
+        {
+            reader->splice = false;
+            for (int i = 0; i < item->count; i++)
+                form_append(form, item->items[i]);
+            item->count = 0;
+            free_form(item);
+        }
+        else
+            form_append(form, item);
+    }
+    return form;
+}
+
+/* Reads the branch of a reader conditional which applies, or else the form
+ * after it.  For #?@, the branch's items are spliced into the enclosing
+ * collection.
+ */
+struct form* form_read_conditional(struct form_reader* reader)
+{
+    _Bool splice = false;
+    if (reader->p < reader->end && '@' == *reader->p)
     {
-        char *host_part = strdup_up_to(port, ':');
-#if defined(_WIN32) || defined(WIN32)
-        size_t hostl = strlen(host_part) + 1;
-        wchar_t *whost = calloc(sizeof(wchar_t), hostl);
-        mbstowcs(whost, host_part, hostl);
-        LPCWSTR whost_part = whost;
-        if (!InetPtonW(AF_INET, whost_part, &address.sin_addr))
-#else
-        if (!inet_aton(host_part, &address.sin_addr))
-#endif
+        reader->p++;
+        splice = true;
+    }
+    struct form* branches = form_read(reader);
+    reader->splice = false;
+    if (!branches || FORM_LIST != branches->type)
+        return branches;
+
+    const char* feature = reader->feature ? reader->feature : ":clj";
+    struct form* selected = NULL;
+    for (int i = 0; i + 1 < branches->count && !selected; i += 2)
+        if (form_is_token(branches->items[i], feature))
+            selected = branches->items[i + 1];
+    for (int i = 0; i + 1 < branches->count && !selected; i += 2)
+        if (form_is_token(branches->items[i], ":default"))
+            selected = branches->items[i + 1];
+    if (!selected)
+    {
+        free_form(branches);
+        return form_read(reader);
+    }
+
+    for (int i = 0; i < branches->count; i++)
+        if (branches->items[i] == selected)
+            branches->items[i] = NULL;
+    free_form(branches);
+    reader->splice = splice && FORM_TOKEN != selected->type && FORM_STRING != selected->type;
+    return selected;
+}
+
+/* Returns NULL at the end of input or at an unexpected closing delimiter. */
+struct form* form_read(struct form_reader* reader)
+{
+    form_skip_whitespace(reader);
+    reader->splice = false;
+    if (reader->p >= reader->end)
+        return NULL;
+    switch (*reader->p)
+    {
+    case '(':
+        reader->p++;
+        return form_read_collection(reader, FORM_LIST, ')');
+    case '[':
+        reader->p++;
+        return form_read_collection(reader, FORM_VECTOR, ']');
+    case '{':
+        reader->p++;
+        return form_read_collection(reader, FORM_MAP, '}');
+    case ')': case ']': case '}':
+        return NULL;
+    case '"':
+        return form_read_string(reader);
+    case '^':
+        reader->p++;
+        free_form(form_read(reader));
+        return form_read(reader);
+    case '\'': case '`': case '~': case '@':
+        reader->p++;
+        if ('@' == *reader->p)
+            reader->p++;
+        return form_read(reader);
+    case '#':
+        reader->p++;
+        if (reader->p >= reader->end)
+            return NULL;
+        switch (*reader->p)
         {
-            struct hostent *ent = gethostbyname(host_part);
-            if (NULL == ent)
-                error(host_part);
-            if (NULL == ent->h_addr)
-            {
-                fprintf(stderr, "%s has no addresses\n", host_part);
-                exit(255);
-            }
-            address.sin_addr.s_addr = *(u_long *)ent->h_addr_list[0];
+        case '{':
+            reader->p++;
+            return form_read_collection(reader, FORM_SET, '}');
+        case '(':
+            reader->p++;
+            return form_read_collection(reader, FORM_LIST, ')');
+        case '"':
+            return form_read_string(reader);
+        case '\'': case '=':
+            reader->p++;
+            return form_read(reader);
+        case '?':
+            reader->p++;
+            return form_read_conditional(reader);
+        default:
+            /* Tagged literals and other dispatch macros: skip the tag. */
+            free_form(form_read_token(reader));
+            return form_read(reader);
         }
-        free(host_part);
-#if defined(_WIN32) || defined(WIN32)
-        whost_part = NULL;
-        free(whost);
-#endif
-        port = strchr(port, ':') + 1;
+    default:
+        return form_read_token(reader);
     }
-    address.sin_port = htons(atoi(port));
-    return address;
 }
 
-char* collect_code(int argc, char *argv[], int start)
+/* Returns the namespace named by FORM if it is an `ns` form, else NULL. */
+char* form_ns_name(struct form* form)
 {
-    size_t code_size = 0;
-    for (int i = optind; i < argc; ++i)
-        code_size += strlen(argv[i]) + 1;
-    char *code = (char *)malloc(code_size);
-    code[0] = '\0';
-    for (int i = optind; i < argc; ++i)
+    if (!form || FORM_LIST != form->type || form->count < 2)
+        return NULL;
+    if (!form_is_token(form->items[0], "ns") && !form_is_token(form->items[0], "clojure.core/ns"))
+        return NULL;
+    if (FORM_TOKEN != form->items[1]->type)
+        return NULL;
+    return strdup(form->items[1]->text);
+}
+
+/* Like form_ns_name(), but also accepts `(in-ns 'NAME)`. */
+char* form_current_ns(struct form* form)
+{
+    if (form && FORM_LIST == form->type && 2 == form->count && FORM_TOKEN == form->items[1]->type &&
+        (form_is_token(form->items[0], "in-ns") || form_is_token(form->items[0], "clojure.core/in-ns")))
+        return strdup(form->items[1]->text);
+    return form_ns_name(form);
+}
+
+void form_add_libspec(struct form* spec, const char* prefix, char*** names, int* count)
+{
+    struct form* lib = spec;
+    if (FORM_VECTOR == spec->type && spec->count > 0)
+        lib = spec->items[0];
+    if (FORM_LIST == spec->type && spec->count > 0 && FORM_TOKEN == spec->items[0]->type && !prefix)
     {
-        if (code[0])
-            strcat(code, " ");
-        strcat(code, argv[i]);
+        for (int i = 1; i < spec->count; i++)
+            form_add_libspec(spec->items[i], spec->items[0]->text, names, count);
+        return;
     }
-    return code;
+    if (FORM_TOKEN != lib->type || ':' == lib->text[0])
+        return;
+    char* name = (char*)malloc((prefix ? strlen(prefix) + 1 : 0) + strlen(lib->text) + 1);
+    sprintf(name, "%s%s%s", prefix ? prefix : "", prefix ? "." : "", lib->text);
+    *names = (char**)realloc(*names, (*count + 1) * sizeof(char*));
+    (*names)[(*count)++] = name;
 }
 
-enum {
-    OPT_OP = 127,
-    OPT_NO_PRINT,
-    OPT_PRINT,
-    OPT_SEND,
-};
+/* Collects the namespaces loaded by the :require and :use clauses of an ns
+ * FORM into a malloc()ed array of malloc()ed names.
+ */
+int form_ns_requires(struct form* form, char*** names)
+{
+    int count = 0;
+    *names = NULL;
+    for (int i = 2; form && i < form->count; i++)
+    {
+        struct form* clause = form->items[i];
+        if (FORM_LIST != clause->type || 0 == clause->count)
+            continue;
+        if (!form_is_token(clause->items[0], ":require") && !form_is_token(clause->items[0], ":use"))
+            continue;
+        for (int j = 1; j < clause->count; j++)
+            form_add_libspec(clause->items[j], NULL, names, &count);
+    }
+    return count;
+}
+
+/* Splits CODE into the source text of its top-level forms, stopping at an
+ * unexpected closing delimiter.  Returns the number of forms.
+ */
+int form_split(const char* code, size_t size, char*** texts)
+{
+    struct form_reader reader = { .p = code, .end = code + size };
+    int count = 0;
+    *texts = NULL;
+    for (;;)
+    {
+        form_skip_whitespace(&reader);
+        const char* start = reader.p;
+        struct form* form = form_read(&reader);
+        if (NULL == form)
+            break;
+        free_form(form);
+        *texts = (char**)realloc(*texts, (count + 1) * sizeof(char*));
+        (*texts)[count] = (char*)malloc(reader.p - start + 1);
+        memcpy((*texts)[count], start, reader.p - start);
+        (*texts)[count][reader.p - start] = '\0';
+        count++;
+    }
+    return count;
+}
 
+/* --- print target ------------------------------------------------------- */
 
-const char SHORT_OPTIONS[] = "hl:n:p:S:v";
-const struct option LONG_OPTIONS[] =
+/* A --print target may be a file instead of a file descriptor.  Files are
+ * only written by the output queue's thread, which rep starts whenever a
+ * file is a target, so the socket reader never waits for the disk.  A file
+ * ending in .gz or .zst is written through gzip or zstd, running alongside
+ * rep.  With --print-rotate, a file is renamed aside, logrotate style, once
+ * that many bytes of output have been written to it.  A compressor which
+ * can't be run stops rep before anything is written; one which exits early
+ * is reported, the rest of that file's output is dropped, and rep exits with
+ * 255 when done.
+ */
+
+#define PRINT_TARGET_FD 1000000
+
+struct print_target
 {
-    { "help",         0, NULL, 'h' },
-    { "line",         1, NULL, 'l' },
-    { "namespace",    1, NULL, 'n' },
-    { "no-print",     1, NULL, OPT_NO_PRINT },
-    { "op",           1, NULL, OPT_OP },
-    { "port",         1, NULL, 'p' },
-    { "print",        1, NULL, OPT_PRINT },
-    { "send",         1, NULL, OPT_SEND },
-    { "session-init", 1, NULL, 'S' },
-    { "verbose",      0, NULL, 'v' },
-    { NULL,           0, NULL, 0 }
+    char* path;
+    const char* const* compressor;
+    int fd;
+#if !defined(_WIN32) && !defined(WIN32)
+    pid_t compressor_pid;
+#endif
+    size_t written;
+    _Bool failed;
+    pthread_mutex_t lock;
 };
 
-struct options* new_options(void)
+const char* const GZIP_COMMAND[] = { "gzip", "-c", NULL };
+const char* const ZSTD_COMMAND[] = { "zstd", "-q", "-c", NULL };
+
+/* Targets are allocated one by one, since their locks can't be moved. */
+struct print_target** print_targets = NULL;
+int print_target_count = 0;
+size_t print_target_rotate_size = 0;
+
+const char* print_target_extension(const char* path)
 {
-    struct options* options = (struct options*)malloc(sizeof(struct options));
-    options->port = strdup("@.nrepl-port@.");
-    options->op = strdup("eval");
-    options->namespace = strdup("user");
-    options->code = NULL;
-    options->help = false;
-    options->line = -1;
-    options->column = -1;
-    options->filename = NULL;
-    options->send = strdup("");
-    options->print = make_default_print_options();
-    options->verbose = false;
-    options->session_init = NULL;
-    return options;
+    size_t length = strlen(path);
+    if (length > 3 && !strcmp(path + length - 3, ".gz"))
+        return path + length - 3;
+    if (length > 4 && !strcmp(path + length - 4, ".zst"))
+        return path + length - 4;
+    return path + length;
 }
 
-void options_parse_line(struct options* options, const char* line)
+void print_target_open(struct print_target* target)
 {
-    int colons = 0;
-    int nondigits = 0;
-    for (const char* p = line; *p; ++p)
+    int fd = open(target->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (-1 == fd)
+        error(target->path);
+    target->written = 0;
+    if (NULL == target->compressor)
     {
-        if (*p == ':')
-            ++colons;
-        else if (!isdigit(*p))
-            ++nondigits;
+        target->fd = fd;
+        return;
     }
-    if (2 == colons)
+#if !defined(_WIN32) && !defined(WIN32)
+    /* The child reports a failed exec on a close-on-exec pipe, so reading
+     * end of file from it means the compressor is running.
+     */
+    int pipe_fds[2], status_fds[2];
+    if (-1 == pipe(pipe_fds) || -1 == pipe(status_fds))
+        error("pipe");
+    fcntl(status_fds[1], F_SETFD, FD_CLOEXEC);
+    target->compressor_pid = fork();
+    if (-1 == target->compressor_pid)
+        error("fork");
+    if (0 == target->compressor_pid)
     {
-        options->filename = strdup_up_to(line, ':');
-        const char* p = strchr(line, ':') + 1;
-        options->line = atoi(p);
-        p = strchr(p, ':') + 1;
-        options->column = atoi(p);
+        /* ^C reaches the whole process group, but the compressor should
+         * finish the file when rep closes the pipe.
+         */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        dup2(pipe_fds[0], 0);
+        dup2(fd, 1);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(status_fds[0]);
+        close(fd);
+        execvp(target->compressor[0], (char* const*)target->compressor);
+        int exec_errno = errno;
+        write_fully(status_fds[1], (const char*)&exec_errno, sizeof(exec_errno));
+        _exit(127);
     }
-    else if (1 == colons && 0 == nondigits)
+    close(status_fds[1]);
+    close(pipe_fds[0]);
+    close(fd);
+    int exec_errno;
+    ssize_t count;
+    while (-1 == (count = read(status_fds[0], &exec_errno, sizeof(exec_errno))) && EINTR == errno)
+        ;
+    close(status_fds[0]);
+    if (count > 0)
+    {
+        close(pipe_fds[1]);
+        while (-1 == waitpid(target->compressor_pid, NULL, 0) && EINTR == errno)
+            ;
+        unlink(target->path);
+        char message[PATH_MAX + 128];
+        snprintf(message, sizeof(message), "rep: %s: unable to run %s: %s", target->path, target->compressor[0], strerror(exec_errno));
+        fail(message);
+    }
+    /* Later compressors must not hold this pipe open. */
+    fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+    target->fd = pipe_fds[1];
+#endif
+}
+
+/* Waits for the compressor, if any, so the file is complete. */
+void print_target_close(struct print_target* target)
+{
+    if (-1 == target->fd)
+        return;
+    close(target->fd);
+    target->fd = -1;
+#if !defined(_WIN32) && !defined(WIN32)
+    if (target->compressor)
+    {
+        int status;
+        while (-1 == waitpid(target->compressor_pid, &status, 0) && EINTR == errno)
+            ;
+        if (!target->failed && !(WIFEXITED(status) && 0 == WEXITSTATUS(status)))
+        {
+            fprintf(stderr, "rep: %s: %s failed\n", target->path, target->compressor[0]);
+            target->failed = true;
+        }
+    }
+#endif
+}
+
+#if !defined(_WIN32) && !defined(WIN32)
+/* Writes to a compressor's pipe with SIGPIPE blocked on this thread, so a
+ * compressor which exits early can't kill rep.  Returns false if it has.
+ */
+_Bool print_target_write_pipe(int fd, const char* data, size_t size)
+{
+    sigset_t pipe_signal, saved;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &saved);
+    _Bool ok = true;
+    while (size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && EINTR == errno)
+            continue;
+        if (count <= 0)
+        {
+            ok = false;
+            break;
+        }
+        data += count;
+        size -= count;
+    }
+    sigset_t pending;
+    int signal_number;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE))
+        sigwait(&pipe_signal, &signal_number);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return ok;
+}
+#endif
+
+char* print_target_rotated_path(struct print_target* target, int number)
+{
+    const char* extension = print_target_extension(target->path);
+    size_t base = extension - target->path;
+    char* path = (char*)malloc(strlen(target->path) + 24);
+    sprintf(path, "%.*s.%d%s", (int)base, target->path, number, extension);
+    return path;
+}
+
+/* Renames PATH.N to PATH.N+1 from the highest N down, and PATH to PATH.1. */
+void print_target_shift(struct print_target* target)
+{
+    int highest = 0;
+    for (;;)
+    {
+        char* path = print_target_rotated_path(target, highest + 1);
+        struct stat st;
+        _Bool exists = 0 == stat(path, &st);
+        free(path);
+        if (!exists)
+            break;
+        highest++;
+    }
+    for (int number = highest; number >= 0; number--)
+    {
+        char* from = number ? print_target_rotated_path(target, number) : strdup(target->path);
+        char* to = print_target_rotated_path(target, number + 1);
+        if (-1 == rename(from, to))
+            perror(from);
+        free(from);
+        free(to);
+    }
+}
+
+void print_target_rotate(struct print_target* target)
+{
+    print_target_close(target);
+    print_target_shift(target);
+    print_target_open(target);
+}
+
+/* Returns the fd which stands for PATH in a print option. */
+int print_target_register(const char* path)
+{
+    for (int i = 0; i < print_target_count; i++)
+        if (!strcmp(print_targets[i]->path, path))
+            return PRINT_TARGET_FD + i;
+
+    print_targets = (struct print_target**)realloc(print_targets, sizeof(struct print_target*) * (print_target_count + 1));
+    struct print_target* target = (struct print_target*)malloc(sizeof(struct print_target));
+    memset(target, 0, sizeof(struct print_target));
+    print_targets[print_target_count] = target;
+    target->path = strdup(path);
+    const char* extension = print_target_extension(path);
+    if (!strcmp(extension, ".gz"))
+        target->compressor = GZIP_COMMAND;
+    else if (!strcmp(extension, ".zst"))
+        target->compressor = ZSTD_COMMAND;
+#if defined(_WIN32) || defined(WIN32)
+    if (target->compressor)
+        fail("rep: compressed --print files are not supported on Windows");
+#endif
+    target->fd = -1;
+    pthread_mutex_init(&target->lock, NULL);
+    return PRINT_TARGET_FD + print_target_count++;
+}
+
+/* Opens the files named by --print once all options are known.  When
+ * rotating, output from an earlier run is moved aside rather than lost.
+ */
+void open_print_targets(void)
+{
+    for (int i = 0; i < print_target_count; i++)
+    {
+        struct stat st;
+        if (print_target_rotate_size > 0 && 0 == stat(print_targets[i]->path, &st) && st.st_size > 0)
+            print_target_shift(print_targets[i]);
+        print_target_open(print_targets[i]);
+    }
+}
+
+void print_target_write(int fd, const char* data, size_t size)
+{
+    if (fd < PRINT_TARGET_FD)
+    {
+        write_fully(fd, data, size);
+        return;
+    }
+    struct print_target* target = print_targets[fd - PRINT_TARGET_FD];
+    pthread_mutex_lock(&target->lock);
+    if (target->failed)
+    {
+        pthread_mutex_unlock(&target->lock);
+        return;
+    }
+    if (print_target_rotate_size > 0 && target->written > 0 && target->written + size > print_target_rotate_size)
+        print_target_rotate(target);
+#if !defined(_WIN32) && !defined(WIN32)
+    if (target->compressor)
+    {
+        if (!print_target_write_pipe(target->fd, data, size))
+        {
+            fprintf(stderr, "rep: %s: %s exited early, dropping further output\n", target->path, target->compressor[0]);
+            target->failed = true;
+        }
+    }
+    else
+#endif
+    write_fully(target->fd, data, size);
+    target->written += size;
+    pthread_mutex_unlock(&target->lock);
+}
+
+/* Returns false if any file couldn't be written completely. */
+_Bool close_print_targets(void)
+{
+    _Bool ok = true;
+    for (int i = 0; i < print_target_count; i++)
+    {
+        print_target_close(print_targets[i]);
+        if (print_targets[i]->failed)
+            ok = false;
+        pthread_mutex_destroy(&print_targets[i]->lock);
+        free(print_targets[i]->path);
+        free(print_targets[i]);
+    }
+    free(print_targets);
+    print_targets = NULL;
+    print_target_count = 0;
+    return ok;
+}
+
+/* --- output queue ------------------------------------------------------- */
+
+/* Printed output is copied into a bounded ring buffer and written by a
+ * separate thread, so that a slow consumer on stdout or stderr never stops
+ * us from reading the socket.  Each entry is a (fd, size) header followed by
+ * the bytes.  With the spill policy, entries which do not fit are kept in a
+ * list in memory instead, and everything after them goes there too until the
+ * writer has caught up, which keeps output in order.  Between writes, the
+ * writer thread moves that list to an anonymous temporary file once it holds
+ * more than the ring's capacity, so only the writer ever touches the disk.
+ */
+
+enum output_policy
+{
+    OUTPUT_BLOCK,
+    OUTPUT_SPILL
+};
+
+struct output_header
+{
+    int fd;
+    size_t size;
+};
+
+struct output_overflow
+{
+    struct output_overflow* next;
+    struct output_header header;
+    char data[];
+};
+
+#define OUTPUT_CHUNK_SIZE 65536
+
+struct output_queue
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    enum output_policy policy;
+    char* ring;
+    size_t capacity;
+    size_t head;
+    size_t used;
+    size_t chunk_size;
+    _Bool overflowing;
+    struct output_overflow* overflow;
+    struct output_overflow** overflow_tail;
+    size_t overflow_size;
+    /* Only the writer thread uses the spill file. */
+    FILE* spill;
+    long spill_read;
+    long spill_write;
+    _Bool closing;
+    struct output_queue* next;
+};
+
+/* Every live queue, so that output queued before fail() or error() exits
+ * is still written.
+ */
+struct output_queue* output_queues = NULL;
+pthread_mutex_t output_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void output_ring_put(struct output_queue* queue, const void* data, size_t size)
+{
+    size_t tail = (queue->head + queue->used) % queue->capacity;
+    size_t first = queue->capacity - tail;
+    if (first > size)
+        first = size;
+    memcpy(queue->ring + tail, data, first);
+    memcpy(queue->ring, (const char*)data + first, size - first);
+    queue->used += size;
+}
+
+void output_ring_get(struct output_queue* queue, void* data, size_t size)
+{
+    size_t first = queue->capacity - queue->head;
+    if (first > size)
+        first = size;
+    memcpy(data, queue->ring + queue->head, first);
+    memcpy((char*)data + first, queue->ring, size - first);
+    queue->head = (queue->head + size) % queue->capacity;
+    queue->used -= size;
+}
+
+void output_overflow_put(struct output_queue* queue, struct output_header header, const char* data)
+{
+    struct output_overflow* entry = (struct output_overflow*)malloc(sizeof(struct output_overflow) + header.size);
+    entry->next = NULL;
+    entry->header = header;
+    memcpy(entry->data, data, header.size);
+    *queue->overflow_tail = entry;
+    queue->overflow_tail = &entry->next;
+    queue->overflow_size += sizeof(struct output_overflow) + header.size;
+    queue->overflowing = true;
+}
+
+void output_spill_put(struct output_queue* queue, const void* data, size_t size)
+{
+    if (NULL == queue->spill)
+    {
+        queue->spill = tmpfile();
+        if (NULL == queue->spill)
+            error("tmpfile");
+    }
+    if (0 != fseek(queue->spill, queue->spill_write, SEEK_SET))
+        error("fseek");
+    if (fwrite(data, 1, size, queue->spill) != size)
+        error("fwrite");
+    queue->spill_write += size;
+}
+
+void output_spill_get(struct output_queue* queue, void* data, size_t size)
+{
+    if (0 != fflush(queue->spill) || 0 != fseek(queue->spill, queue->spill_read, SEEK_SET))
+        error("fseek");
+    if (fread(data, 1, size, queue->spill) != size)
+        error("fread");
+    queue->spill_read += size;
+}
+
+/* Moves the overflow list, which is newer than anything already spilled, to
+ * the end of the spill file.
+ */
+void output_spill_overflow(struct output_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    struct output_overflow* entries = queue->overflow;
+    queue->overflow = NULL;
+    queue->overflow_tail = &queue->overflow;
+    queue->overflow_size = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    while (entries)
+    {
+        struct output_overflow* next = entries->next;
+        output_spill_put(queue, &entries->header, sizeof(entries->header));
+        output_spill_put(queue, entries->data, entries->header.size);
+        free(entries);
+        entries = next;
+    }
+}
+
+void* output_queue_writer(void* arg)
+{
+    struct output_queue* queue = (struct output_queue*)arg;
+    char* buffer = (char*)malloc(queue->chunk_size);
+    for (;;)
+    {
+        struct output_header header;
+        struct output_overflow* entry = NULL;
+        const char* data = buffer;
+        pthread_mutex_lock(&queue->lock);
+        while (0 == queue->used && !queue->overflowing && !queue->closing)
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        if (queue->used > 0)
+        {
+            output_ring_get(queue, &header, sizeof(header));
+            output_ring_get(queue, buffer, header.size);
+            pthread_cond_broadcast(&queue->not_full);
+            pthread_mutex_unlock(&queue->lock);
+        }
+        else if (queue->spill_read != queue->spill_write)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            output_spill_get(queue, &header, sizeof(header));
+            output_spill_get(queue, buffer, header.size);
+            if (queue->spill_read == queue->spill_write)
+            {
+                queue->spill_read = queue->spill_write = 0;
+                if (0 != fflush(queue->spill) || 0 != ftruncate(fileno(queue->spill), 0))
+                    error("ftruncate");
+            }
+        }
+        else if (queue->overflow)
+        {
+            entry = queue->overflow;
+            queue->overflow = entry->next;
+            if (NULL == queue->overflow)
+                queue->overflow_tail = &queue->overflow;
+            queue->overflow_size -= sizeof(struct output_overflow) + entry->header.size;
+            pthread_mutex_unlock(&queue->lock);
+            header = entry->header;
+            data = entry->data;
+        }
+        else if (queue->overflowing)
+        {
+            queue->overflowing = false;
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+        else
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        print_target_write(header.fd, data, header.size);
+        free(entry);
+
+        pthread_mutex_lock(&queue->lock);
+        _Bool spill = queue->overflow_size > queue->capacity;
+        pthread_mutex_unlock(&queue->lock);
+        if (spill)
+            output_spill_overflow(queue);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void drain_output_queues(void);
+
+struct output_queue* make_output_queue(size_t capacity, enum output_policy policy)
+{
+    struct output_queue* queue = (struct output_queue*)malloc(sizeof(struct output_queue));
+    memset(queue, 0, sizeof(struct output_queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    queue->policy = policy;
+    queue->capacity = capacity;
+    queue->ring = (char*)malloc(capacity);
+    queue->overflow_tail = &queue->overflow;
+    queue->chunk_size = capacity / 2 - sizeof(struct output_header);
+    if (queue->chunk_size > OUTPUT_CHUNK_SIZE)
+        queue->chunk_size = OUTPUT_CHUNK_SIZE;
+    if (0 != pthread_create(&queue->thread, NULL, output_queue_writer, queue))
+        fail("rep: unable to start output thread");
+
+    static _Bool registered = false;
+    pthread_mutex_lock(&output_queues_lock);
+    queue->next = output_queues;
+    output_queues = queue;
+    if (!registered)
+        atexit(drain_output_queues);
+    registered = true;
+    pthread_mutex_unlock(&output_queues_lock);
+    return queue;
+}
+
+void output_queue_write(struct output_queue* queue, int fd, const char* data, size_t size)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (size > 0)
+    {
+        struct output_header header = { .fd = fd, .size = size };
+        if (header.size > queue->chunk_size)
+            header.size = queue->chunk_size;
+        size_t needed = sizeof(header) + header.size;
+        if (OUTPUT_SPILL == queue->policy && (queue->overflowing || queue->capacity - queue->used < needed))
+            output_overflow_put(queue, header, data);
+        else
+        {
+            while (queue->capacity - queue->used < needed)
+                pthread_cond_wait(&queue->not_full, &queue->lock);
+            output_ring_put(queue, &header, sizeof(header));
+            output_ring_put(queue, data, header.size);
+        }
+        /* Wake the writer for each chunk, so that it empties the ring while
+         * we wait for room for the next one.
+         */
+        pthread_cond_signal(&queue->not_empty);
+        data += header.size;
+        size -= header.size;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void output_queue_close(struct output_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closing = true;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+}
+
+/* Waits for all queued output to be written. */
+void free_output_queue(struct output_queue* queue)
+{
+    pthread_mutex_lock(&output_queues_lock);
+    for (struct output_queue** p = &output_queues; *p; p = &(*p)->next)
+        if (*p == queue)
+        {
+            *p = queue->next;
+            break;
+        }
+    pthread_mutex_unlock(&output_queues_lock);
+
+    output_queue_close(queue);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    if (queue->spill)
+        fclose(queue->spill);
+    free(queue->ring);
+    free(queue);
+}
+
+/* Runs at exit, which is the only way out of fail() and error().  A failure
+ * on a writer thread itself can't wait for that thread.
+ */
+void drain_output_queues(void)
+{
+    pthread_mutex_lock(&output_queues_lock);
+    for (struct output_queue* queue = output_queues; queue; queue = queue->next)
+        if (!pthread_equal(queue->thread, pthread_self()))
+            output_queue_close(queue);
+    output_queues = NULL;
+    pthread_mutex_unlock(&output_queues_lock);
+}
+
+/* -- io_uring ------------------------------------------------------------ */
+
+#if defined(REP_IO_URING)
+
+/* With --io=uring, the --bench and --jobs event loop queues its socket
+ * receives and sends and its output writes on an io_uring, so that a single
+ * io_uring_enter() call both submits and reaps the I/O of every connection.
+ * Where the kernel supports it, each connection receives into a ring of
+ * registered buffers with one multishot recv.  This talks to the kernel
+ * directly, so liburing is not needed.  Building with -DREP_NO_IO_URING, or
+ * a kernel without io_uring, leaves the portable poll() loop.
+ */
+
+#define URING_BUFFER_COUNT 64
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t rings_size;
+    size_t sqes_size;
+    unsigned to_submit;
+    struct io_uring_buf_ring* buffers;
+    char* buffer_memory;
+    _Bool multishot;
+};
+
+int uring_enter(struct uring* uring, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    for (;;)
+    {
+        int result = (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags, NULL, 0);
+        if (result >= 0)
+            return result;
+        if (EINTR != errno && EAGAIN != errno && EBUSY != errno)
+            error("io_uring_enter");
+    }
+}
+
+/* Registers a ring of receive buffers for multishot recv.  Fails quietly on
+ * kernels which don't support it.
+ */
+void uring_setup_buffers(struct uring* uring)
+{
+#if defined(IORING_RECV_MULTISHOT)
+    size_t ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == ring)
+        return;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(ring, ring_size);
+        return;
+    }
+    uring->buffers = (struct io_uring_buf_ring*)ring;
+    uring->buffer_memory = (char*)malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    for (int i = 0; i < URING_BUFFER_COUNT; i++)
+    {
+        struct io_uring_buf* buffer = &uring->buffers->bufs[i];
+        buffer->addr = (uintptr_t)(uring->buffer_memory + i * URING_BUFFER_SIZE);
+        buffer->len = URING_BUFFER_SIZE;
+        buffer->bid = i;
+    }
+    __atomic_store_n(&uring->buffers->tail, URING_BUFFER_COUNT, __ATOMIC_RELEASE);
+    uring->multishot = true;
+#endif
+}
+
+/* Returns NULL if the kernel doesn't allow io_uring. */
+struct uring* make_uring(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return NULL;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct uring* uring = (struct uring*)calloc(1, sizeof(struct uring));
+    uring->fd = fd;
+    uring->entries = params.sq_entries;
+    uring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > uring->rings_size)
+        uring->rings_size = cq_size;
+    uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe*)mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (MAP_FAILED == uring->rings || MAP_FAILED == (void*)uring->sqes)
+        error("mmap");
+
+    char* rings = (char*)uring->rings;
+    uring->sq_head = (unsigned*)(rings + params.sq_off.head);
+    uring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    uring->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    uring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    uring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    uring->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    uring_setup_buffers(uring);
+    return uring;
+}
+
+void free_uring(struct uring* uring)
+{
+    close(uring->fd);
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->rings, uring->rings_size);
+    if (uring->buffers)
+    {
+        munmap(uring->buffers, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+        free(uring->buffer_memory);
+    }
+    free(uring);
+}
+
+/* Returns a cleared submission queue entry, submitting what's queued if the
+ * queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* uring, uint64_t user_data)
+{
+    unsigned tail = *uring->sq_tail;
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->entries)
+    {
+        uring_enter(uring, uring->to_submit, 0);
+        uring->to_submit = 0;
+    }
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+    return sqe;
+}
+
+/* Submits everything queued and waits for at least one completion. */
+void uring_submit_and_wait(struct uring* uring)
+{
+    unsigned to_submit = uring->to_submit;
+    uring->to_submit = 0;
+    uring_enter(uring, to_submit, 1);
+}
+
+_Bool uring_next_completion(struct uring* uring, struct io_uring_cqe* cqe)
+{
+    unsigned head = *uring->cq_head;
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    *cqe = uring->cqes[head & *uring->cq_mask];
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+const char* uring_buffer(struct uring* uring, unsigned bid)
+{
+    return uring->buffer_memory + bid * URING_BUFFER_SIZE;
+}
+
+/* Gives a receive buffer back to the kernel once its data is copied out. */
+void uring_recycle_buffer(struct uring* uring, unsigned bid)
+{
+#if defined(IORING_RECV_MULTISHOT)
+    unsigned short tail = uring->buffers->tail;
+    struct io_uring_buf* buffer = &uring->buffers->bufs[tail & (URING_BUFFER_COUNT - 1)];
+    buffer->addr = (uintptr_t)uring_buffer(uring, bid);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = bid;
+    __atomic_store_n(&uring->buffers->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+#endif
+}
+
+/* Bytes to write in order, to one or more fds, one write at a time.  The
+ * kernel reads the bytes being written in place, so new bytes are queued
+ * in a second buffer until they are all written, then the buffers swap.
+ */
+
+struct uring_segment
+{
+    int fd;
+    size_t length;
+};
+
+struct uring_buffer
+{
+    char* data;
+    size_t length;
+    size_t allocated;
+    struct uring_segment* segments;
+    int segment_count;
+    int segments_allocated;
+};
+
+struct uring_stream
+{
+    _Bool socket;
+    _Bool in_flight;
+    struct uring_buffer queued;
+    struct uring_buffer writing;
+    int segment;
+    size_t offset;
+    size_t segment_written;
+};
+
+void free_uring_stream(struct uring_stream* stream)
+{
+    free(stream->queued.data);
+    free(stream->queued.segments);
+    free(stream->writing.data);
+    free(stream->writing.segments);
+}
+
+void uring_stream_append(struct uring_stream* stream, int fd, const char* data, size_t size)
+{
+    struct uring_buffer* queued = &stream->queued;
+    if (0 == size)
+        return;
+    if (queued->length + size > queued->allocated)
+    {
+        queued->allocated = (queued->length + size) * 2;
+        queued->data = (char*)realloc(queued->data, queued->allocated);
+    }
+    memcpy(queued->data + queued->length, data, size);
+    queued->length += size;
+    if (queued->segment_count > 0 && queued->segments[queued->segment_count - 1].fd == fd)
+    {
+        queued->segments[queued->segment_count - 1].length += size;
+        return;
+    }
+    if (queued->segment_count == queued->segments_allocated)
+    {
+        queued->segments_allocated = queued->segments_allocated ? queued->segments_allocated * 2 : 8;
+        queued->segments = (struct uring_segment*)realloc(queued->segments, queued->segments_allocated * sizeof(struct uring_segment));
+    }
+    queued->segments[queued->segment_count].fd = fd;
+    queued->segments[queued->segment_count].length = size;
+    queued->segment_count++;
+}
+
+_Bool uring_stream_busy(struct uring_stream* stream)
+{
+    return stream->in_flight || stream->segment < stream->writing.segment_count || stream->queued.length > 0;
+}
+
+/* Queues the next write of STREAM, if there is something to write and no
+ * write in flight.
+ */
+void uring_stream_submit(struct uring* uring, struct uring_stream* stream, uint64_t user_data)
+{
+    if (stream->in_flight)
+        return;
+    if (stream->segment >= stream->writing.segment_count)
+    {
+        if (0 == stream->queued.length)
+            return;
+        struct uring_buffer written = stream->writing;
+        stream->writing = stream->queued;
+        stream->queued = written;
+        stream->queued.length = 0;
+        stream->queued.segment_count = 0;
+        stream->segment = 0;
+        stream->offset = 0;
+        stream->segment_written = 0;
+    }
+    struct uring_segment* segment = &stream->writing.segments[stream->segment];
+    struct io_uring_sqe* sqe = uring_get_sqe(uring, user_data);
+    sqe->opcode = stream->socket ? IORING_OP_SEND : IORING_OP_WRITE;
+    sqe->fd = segment->fd;
+    sqe->addr = (uintptr_t)(stream->writing.data + stream->offset + stream->segment_written);
+    sqe->len = segment->length - stream->segment_written;
+    if (stream->socket)
+        sqe->msg_flags = MSG_NOSIGNAL;
+    else
+        sqe->off = (uint64_t)-1;
+    stream->in_flight = true;
+}
+
+/* Accounts for a completed write of RESULT bytes, which start at DATA.  A
+ * failed write drops the rest of its segment and returns the error.
+ */
+int uring_stream_complete(struct uring_stream* stream, int result, const char** data)
+{
+    struct uring_segment* segment = &stream->writing.segments[stream->segment];
+    stream->in_flight = false;
+    *data = stream->writing.data + stream->offset + stream->segment_written;
+    if (-EINTR == result || -EAGAIN == result)
+        return 0;
+    if (result < 0)
+        stream->segment_written = segment->length;
+    else
+        stream->segment_written += result;
+    if (stream->segment_written == segment->length)
+    {
+        stream->offset += segment->length;
+        stream->segment++;
+        stream->segment_written = 0;
+        if (stream->segment == stream->writing.segment_count)
+            stream->writing.length = 0;
+    }
+    return result;
+}
+
+#endif
+
+/* -- print option -------------------------------------------------------- */
+
+struct print_option
+{
+    struct print_option* next;
+    char* key;
+    int fd;
+    char* format;
+};
+
+struct print_option* make_print_option(const char* optarg)
+{
+    struct print_option* print = (struct print_option*)malloc(sizeof(struct print_option));
+    memset(print, 0, sizeof(struct print_option));
+    print->next = NULL;
+    print->fd = 1;
+    if (!strchr(optarg, ','))
+    {
+        print->key = strdup(optarg);
+        print->format = (char*)malloc(strlen(optarg) + 4);
+        sprintf(print->format, "%%{%s}", optarg);
+    }
+    else
+    {
+        print->key = strdup_up_to(optarg, ',');
+        const char* p = strchr(optarg, ',') + 1;
+        if (NULL == strchr(p, ','))
+            options_fail("--print option is either KEY or KEY,FD|FILE,FORMAT");
+        char* target = strdup_up_to(p, ',');
+        const char* digits = '-' == *target ? target + 1 : target;
+        if (*digits && strspn(digits, "0123456789") == strlen(digits))
+            print->fd = atoi(target);
+        else
+            print->fd = print_target_register(target);
+        free(target);
+        p = strchr(p, ',') + 1;
+        print->format = strdup(p);
+    }
+    return print;
+}
+
+void free_print_options(struct print_option* print)
+{
+    while (print)
+    {
+        if (print->key)
+            free(print->key);
+        if (print->format)
+            free(print->format);
+        void* p = print;
+        print = print->next;
+        free(p);
+    }
+}
+
+void append_print_option(struct print_option** options, struct print_option* new)
+{
+    while (*options)
+        options = &(*options)->next;
+    *options = new;
+}
+
+void remove_print_option(struct print_option** options, const char* key)
+{
+    while (*options)
+    {
+        if (!strcmp((*options)->key, key))
+        {
+            struct print_option* dead = *options;
+            *options = (*options)->next;
+            dead->next = NULL;
+            free_print_options(dead);
+        }
+        else
+            options = &(*options)->next;
+    }
+}
+
+struct print_option* copy_print_options(struct print_option* print)
+{
+    struct print_option* result = NULL;
+    for (; print; print = print->next)
+    {
+        struct print_option* copy = (struct print_option*)malloc(sizeof(struct print_option));
+        copy->next = NULL;
+        copy->key = strdup(print->key);
+        copy->fd = print->fd;
+        copy->format = strdup(print->format);
+        append_print_option(&result, copy);
+    }
+    return result;
+}
+
+struct print_option* make_default_print_options(void)
+{
+    struct print_option* result = make_print_option("out,1,%{out}");
+    append_print_option(&result, make_print_option("err,2,%{err}"));
+    append_print_option(&result, make_print_option("value,1,%{value}%n"));
+    return result;
+}
+
+/* -- options ------------------------------------------------------------- */
+
+struct options
+{
+    char* port;
+    char* namespace;
+    char* op;
+    char* code;
+    char* filename;
+    int line;
+    int column;
+    char* send;
+    _Bool help;
+    struct print_option* print;
+    _Bool verbose;
+    char* session_init;
+    size_t output_queue_size;
+    enum output_policy output_policy;
+    _Bool wait;
+    long wait_timeout_ms;
+    char* watch;
+    long debounce_ms;
+    char* sync;
+    long bench_requests;
+    int bench_concurrency;
+    _Bool bench_reuse_sessions;
+    int jobs;
+    int jobs_connections;
+    _Bool jobs_labeled;
+    _Bool io_uring;
+    _Bool print_stream;
+    _Bool on_exception;
+    char* on_exception_op;
+    const struct quoting* quoting;
+    char* sideload;
+    char* supersede;
+    _Bool tail;
+    char* record;
+    char* replay;
+    _Bool replay_fast;
+};
+
+struct sockaddr_in options_address(struct options* options, const char* port);
+
+char *read_file(const char* filename, char* buffer, size_t buffer_size)
+{
+    FILE *portfile = fopen(filename, "r");
+    if (NULL == portfile)
+        return NULL;
+    if (NULL == fgets(buffer, buffer_size, portfile))
+    {
+        fclose(portfile);
+        return NULL;
+    }
+    fclose(portfile);
+    return buffer;
+}
+
+struct sockaddr_in options_address_from_file(struct options* options, const char* filename)
+{
+    char linebuffer[256];
+    if (!read_file(filename, linebuffer, sizeof(linebuffer)))
+        error(filename);
+    return options_address(options, linebuffer);
+}
+
+/* Returns the path of FILENAME in DIRECTORY or its nearest ancestor, or NULL. */
+char* find_in_ancestors(const char* directory_in, const char* filename)
+{
+    char *directory = strdup(directory_in);
+    for (;;)
+    {
+#if defined(_WIN32) || defined(WIN32)
+        struct _stat statb;
+#else
+        struct stat statb;
+#endif
+        char* path_to_check = (char*)malloc(strlen(directory) + strlen(filename) + 2);
+        sprintf(path_to_check, "%s/%s", directory, filename);
+#if defined(_WIN32) || defined(WIN32)
+        if (0 == _stat(path_to_check, &statb))
+#else
+        if (0 == stat(path_to_check, &statb))
+#endif
+        {
+            free(directory);
+            return path_to_check;
+        }
+        free(path_to_check);
+
+        char* old_directory = strdup(directory);
+        char* parent_directory = dirname(directory);
+        if (!strcmp(old_directory, parent_directory))
+        {
+            free(old_directory);
+            free(directory);
+            return NULL;
+        }
+        free(old_directory);
+        char* new_directory = strdup(parent_directory);
+        free(directory);
+        directory = new_directory;
+    }
+}
+
+struct sockaddr_in options_address_from_relative_file(struct options* options, const char* directory_in, const char* filename)
+{
+    char* path = find_in_ancestors(directory_in, filename);
+    if (NULL == path)
+    {
+        char error_message[PATH_MAX + 128];
+        sprintf(error_message, "rep: No ancestor of %s contains %s", directory_in, filename);
+        fail(error_message);
+    }
+    struct sockaddr_in result = options_address_from_file(options, path);
+    free(path);
+    return result;
+}
+
+char* make_path_absolute(const char* path)
+{
+    if (*path == '/')
+        return strdup(path);
+    char* absolute_directory = (char*)malloc(strlen(path) + PATH_MAX + 2);
+    if (NULL == getcwd(absolute_directory, PATH_MAX))
+        error("getcwd");
+    strcat(absolute_directory, "/");
+    strcat(absolute_directory, path);
+    return absolute_directory;
+}
+
+struct sockaddr_in options_address(struct options* options, const char* port)
+{
+    if (*port == '@' && !strchr(port + 1, '@'))
+        return options_address_from_file(options, port + 1);
+    else if (*port == '@')
+    {
+        const char* relative_directory = strchr(port + 1, '@') + 1;
+        char* absolute_directory = make_path_absolute(relative_directory);
+        char* filename = strdup_up_to(port + 1, '@');
+        struct sockaddr_in result = options_address_from_relative_file(options, absolute_directory, filename);
+        free(absolute_directory);
+        free(filename);
+        return result;
+    }
+    struct sockaddr_in address =
+    {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    if (strchr(port, ':'))
+    {
+        char *host_part = strdup_up_to(port, ':');
+#if defined(_WIN32) || defined(WIN32)
+        size_t hostl = strlen(host_part) + 1;
+        wchar_t *whost = calloc(sizeof(wchar_t), hostl);
+        mbstowcs(whost, host_part, hostl);
+        LPCWSTR whost_part = whost;
+        if (!InetPtonW(AF_INET, whost_part, &address.sin_addr))
+#else
+        if (!inet_aton(host_part, &address.sin_addr))
+#endif
+        {
+            struct hostent *ent = gethostbyname(host_part);
+            if (NULL == ent)
+                error(host_part);
+            if (NULL == ent->h_addr)
+            {
+                fprintf(stderr, "%s has no addresses\n", host_part);
+                exit(255);
+            }
+            address.sin_addr.s_addr = *(u_long *)ent->h_addr_list[0];
+        }
+        free(host_part);
+#if defined(_WIN32) || defined(WIN32)
+        whost_part = NULL;
+        free(whost);
+#endif
+        port = strchr(port, ':') + 1;
+    }
+    address.sin_port = htons(atoi(port));
+    return address;
+}
+
+/* True if the port file named by PORT, if any, exists and is not empty. */
+_Bool options_port_file_ready(const char* port)
+{
+    if (*port != '@')
+        return true;
+    char* path = NULL;
+    if (!strchr(port + 1, '@'))
+        path = strdup(port + 1);
+    else
+    {
+        char* absolute_directory = make_path_absolute(strchr(port + 1, '@') + 1);
+        char* filename = strdup_up_to(port + 1, '@');
+        path = find_in_ancestors(absolute_directory, filename);
+        free(absolute_directory);
+        free(filename);
+    }
+    char linebuffer[256];
+    _Bool ready = path && read_file(path, linebuffer, sizeof(linebuffer));
+    free(path);
+    return ready;
+}
+
+/* Sleeps until something changes in a directory where the port file named
+ * by PORT could appear, or until TIMEOUT_MS passes.  Without inotify, this
+ * just polls.
+ */
+void options_wait_for_port_file(const char* port, long timeout_ms)
+{
+#if defined(__linux__)
+    int watch = inotify_init1(IN_CLOEXEC);
+    if (-1 == watch)
+        error("inotify_init1");
+    char* directory = NULL;
+    if (!strchr(port + 1, '@'))
+    {
+        char* absolute_path = make_path_absolute(port + 1);
+        directory = strdup(dirname(absolute_path));
+        free(absolute_path);
+    }
+    else
+        directory = make_path_absolute(strchr(port + 1, '@') + 1);
+    for (;;)
+    {
+        (void)inotify_add_watch(watch, directory, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+        char* old_directory = strdup(directory);
+        char* parent = strdup(dirname(directory));
+        _Bool at_root = !strcmp(parent, old_directory);
+        free(old_directory);
+        free(directory);
+        directory = parent;
+        if (at_root)
+            break;
+    }
+    free(directory);
+
+    /* The watches must be in place before we look, or we could miss it. */
+    if (!options_port_file_ready(port))
+    {
+        struct pollfd pfd = { .fd = watch, .events = POLLIN };
+        if (-1 == poll(&pfd, 1, timeout_ms < 0 ? -1 : (int)timeout_ms) && EINTR != errno)
+            error("poll");
+    }
+    close(watch);
+#else
+    if (timeout_ms < 0 || timeout_ms > 100)
+        timeout_ms = 100;
+    sleep_ms(timeout_ms);
+#endif
+}
+
+char* collect_code(int argc, char *argv[], int start)
+{
+    size_t code_size = 0;
+    for (int i = optind; i < argc; ++i)
+        code_size += strlen(argv[i]) + 1;
+    char *code = (char *)malloc(code_size);
+    code[0] = '\0';
+    for (int i = optind; i < argc; ++i)
+    {
+        if (code[0])
+            strcat(code, " ");
+        strcat(code, argv[i]);
+    }
+    return code;
+}
+
+size_t parse_size(const char* text, const char* what)
+{
+    char* end = NULL;
+    errno = 0;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text || !isdigit((unsigned char)*text) || ERANGE == errno)
+        options_fail(what);
+    int shift = 0;
+    switch (*end)
+    {
+    case 'g': case 'G': shift += 10; /* fall through */
+    case 'm': case 'M': shift += 10; /* fall through */
+    case 'k': case 'K': shift += 10; ++end; break;
+    }
+    if (*end && *end != ',')
+        options_fail(what);
+    if (size > (SIZE_MAX >> shift))
+        options_fail(what);
+    return (size_t)size << shift;
+}
+
+void options_parse_output_queue(struct options* options, const char* arg)
+{
+    static const char MESSAGE[] = "--output-queue value must be SIZE[,block|spill] with SIZE of at least 1k";
+    options->output_queue_size = parse_size(arg, MESSAGE);
+    if (options->output_queue_size < 1024)
+        options_fail(MESSAGE);
+    const char* policy = strchr(arg, ',');
+    if (NULL == policy || !strcmp(policy + 1, "spill"))
+        options->output_policy = OUTPUT_SPILL;
+    else if (!strcmp(policy + 1, "block"))
+        options->output_policy = OUTPUT_BLOCK;
+    else
+        options_fail(MESSAGE);
+}
+
+void options_parse_wait(struct options* options, const char* arg)
+{
+    options->wait = true;
+    options->wait_timeout_ms = -1;
+    if (NULL == arg)
+        return;
+    char* end = NULL;
+    double seconds = strtod(arg, &end);
+    if (end == arg || *end || seconds < 0)
+        options_fail("--wait value must be a number of seconds");
+    options->wait_timeout_ms = (long)(seconds * 1000);
+}
+
+void options_parse_bench(struct options* options, const char* arg)
+{
+    static const char MESSAGE[] = "--bench value must be N[,CONCURRENCY]";
+#if defined(_WIN32) || defined(WIN32)
+    options_fail("--bench is not supported on Windows");
+#endif
+    char* end = NULL;
+    options->bench_requests = strtol(arg, &end, 10);
+    if (end == arg || options->bench_requests < 1)
+        options_fail(MESSAGE);
+    options->bench_concurrency = 1;
+    if (',' == *end)
+    {
+        const char* concurrency = end + 1;
+        options->bench_concurrency = (int)strtol(concurrency, &end, 10);
+        if (end == concurrency || options->bench_concurrency < 1)
+            options_fail(MESSAGE);
+    }
+    if (*end)
+        options_fail(MESSAGE);
+}
+
+void options_parse_jobs(struct options* options, const char* arg)
+{
+    static const char MESSAGE[] = "--jobs value must be N[,CONNECTIONS]";
+#if defined(_WIN32) || defined(WIN32)
+    options_fail("--jobs is not supported on Windows");
+#endif
+    char* end = NULL;
+    options->jobs = (int)strtol(arg, &end, 10);
+    if (end == arg || options->jobs < 1)
+        options_fail(MESSAGE);
+    options->jobs_connections = 1;
+    if (',' == *end)
+    {
+        const char* connections = end + 1;
+        options->jobs_connections = (int)strtol(connections, &end, 10);
+        if (end == connections || options->jobs_connections < 1)
+            options_fail(MESSAGE);
+    }
+    if (*end)
+        options_fail(MESSAGE);
+}
+
+enum {
+    OPT_BENCH = 127,
+    OPT_BENCH_SESSIONS,
+    OPT_DEBOUNCE,
+    OPT_IO,
+    OPT_JOBS,
+    OPT_JOBS_OUTPUT,
+    OPT_OP,
+    OPT_NO_PRINT,
+    OPT_ON_EXCEPTION,
+    OPT_OUTPUT_QUEUE,
+    OPT_PRINT,
+    OPT_PRINT_BUFFER_SIZE,
+    OPT_PRINT_QUOTA,
+    OPT_PRINT_ROTATE,
+    OPT_PRINT_STREAM,
+    OPT_PRINTER,
+    OPT_QUOTE,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_REPLAY_SPEED,
+    OPT_SEND,
+    OPT_SIDELOAD,
+    OPT_SUPERSEDE,
+    OPT_SYNC,
+    OPT_TAIL,
+    OPT_WAIT,
+    OPT_WATCH,
+};
+
+
+const char SHORT_OPTIONS[] = "hl:n:p:S:v";
+const struct option LONG_OPTIONS[] =
+{
+    { "bench",          1, NULL, OPT_BENCH },
+    { "bench-sessions", 1, NULL, OPT_BENCH_SESSIONS },
+    { "debounce",       1, NULL, OPT_DEBOUNCE },
+    { "help",           0, NULL, 'h' },
+    { "io",             1, NULL, OPT_IO },
+    { "jobs",           1, NULL, OPT_JOBS },
+    { "jobs-output",    1, NULL, OPT_JOBS_OUTPUT },
+    { "line",           1, NULL, 'l' },
+    { "namespace",      1, NULL, 'n' },
+    { "no-print",       1, NULL, OPT_NO_PRINT },
+    { "on-exception",   1, NULL, OPT_ON_EXCEPTION },
+    { "op",             1, NULL, OPT_OP },
+    { "output-queue",   1, NULL, OPT_OUTPUT_QUEUE },
+    { "port",           1, NULL, 'p' },
+    { "print",          1, NULL, OPT_PRINT },
+    { "print-buffer-size", 1, NULL, OPT_PRINT_BUFFER_SIZE },
+    { "print-quota",    1, NULL, OPT_PRINT_QUOTA },
+    { "print-rotate",   1, NULL, OPT_PRINT_ROTATE },
+    { "print-stream",   0, NULL, OPT_PRINT_STREAM },
+    { "printer",        1, NULL, OPT_PRINTER },
+    { "quote",          1, NULL, OPT_QUOTE },
+    { "record",         1, NULL, OPT_RECORD },
+    { "replay",         1, NULL, OPT_REPLAY },
+    { "replay-speed",   1, NULL, OPT_REPLAY_SPEED },
+    { "send",           1, NULL, OPT_SEND },
+    { "session-init",   1, NULL, 'S' },
+    { "sideload",       1, NULL, OPT_SIDELOAD },
+    { "supersede",      1, NULL, OPT_SUPERSEDE },
+    { "sync",           1, NULL, OPT_SYNC },
+    { "tail",           0, NULL, OPT_TAIL },
+    { "verbose",        0, NULL, 'v' },
+    { "wait",           2, NULL, OPT_WAIT },
+    { "watch",          1, NULL, OPT_WATCH },
+    { NULL,             0, NULL, 0 }
+};
+
+struct options* new_options(void)
+{
+    struct options* options = (struct options*)malloc(sizeof(struct options));
+    options->port = strdup("@.nrepl-port@.");
+    options->op = strdup("eval");
+    options->namespace = strdup("user");
+    options->code = NULL;
+    options->help = false;
+    options->line = -1;
+    options->column = -1;
+    options->filename = NULL;
+    options->send = strdup("");
+    options->print = make_default_print_options();
+    options->verbose = false;
+    options->session_init = NULL;
+    options->output_queue_size = 0;
+    options->output_policy = OUTPUT_SPILL;
+    options->wait = false;
+    options->wait_timeout_ms = -1;
+    options->watch = NULL;
+    options->debounce_ms = 100;
+    options->sync = NULL;
+    options->bench_requests = 0;
+    options->bench_concurrency = 1;
+    options->bench_reuse_sessions = false;
+    options->jobs = 0;
+    options->jobs_connections = 1;
+    options->jobs_labeled = false;
+    options->io_uring = false;
+    options->print_stream = false;
+    options->on_exception = false;
+    options->on_exception_op = NULL;
+    options->quoting = find_quoting("none");
+    options->sideload = NULL;
+    options->supersede = NULL;
+    options->tail = false;
+    options->record = NULL;
+    options->replay = NULL;
+    options->replay_fast = false;
+    return options;
+}
+
+void options_parse_line(struct options* options, const char* line)
+{
+    int colons = 0;
+    int nondigits = 0;
+    for (const char* p = line; *p; ++p)
+    {
+        if (*p == ':')
+            ++colons;
+        else if (!isdigit(*p))
+            ++nondigits;
+    }
+    if (2 == colons)
+    {
+        options->filename = strdup_up_to(line, ':');
+        const char* p = strchr(line, ':') + 1;
+        options->line = atoi(p);
+        p = strchr(p, ':') + 1;
+        options->column = atoi(p);
+    }
+    else if (1 == colons && 0 == nondigits)
+    {
+        options->line = atoi(line);
+        options->column = atoi(strchr(line, ':') + 1);
+    }
+    else if (1 == colons)
+    {
+        options->filename = strdup_up_to(line, ':');
+        options->line = atoi(strchr(line, ':') + 1);
+    }
+    else if (0 == colons && 0 == nondigits)
+        options->line = atoi(line);
+    else if (0 == colons)
+    {
+        options->filename = strdup(line);
+        options->line = 1;
+    }
+    else
+        options_fail("invalid value for --line");
+}
+
+void options_parse_on_exception(struct options* options, const char* arg)
+{
+    static const char MESSAGE[] = "--on-exception value must be 'stacktrace' or 'op:NAME'";
+    if (options->on_exception_op)
+        free(options->on_exception_op);
+    options->on_exception_op = NULL;
+    if (!strncmp(arg, "op:", 3) && arg[3])
+        options->on_exception_op = strdup(arg + 3);
+    else if (strcmp(arg, "stacktrace"))
+        options_fail(MESSAGE);
+    options->on_exception = true;
+}
+
+void options_send_string(struct options* options, const char* key, const char* value)
+{
+    options->send = (char*)realloc(options->send, strlen(options->send) + strlen(key) + strlen(value) + 48);
+    sprintf(options->send + strlen(options->send), "%lu:%s%lu:%s", strlen(key), key, strlen(value), value);
+}
+
+void options_send_integer(struct options* options, const char* key, long long value)
+{
+    options->send = (char*)realloc(options->send, strlen(options->send) + strlen(key) + 48);
+    sprintf(options->send + strlen(options->send), "%lu:%si%llde", strlen(key), key, value);
+}
+
+void options_parse_send(struct options* options, const char* send)
+{
+    char* key = NULL;
+    char* type = NULL;
+
+    if (NULL == strchr(send, ','))
+        options_fail("--send value must be KEY,TYPE,VALUE");
+    key = strdup_up_to(send, ',');
+    send = strchr(send, ',') + 1;
+
+    if (NULL == strchr(send, ','))
+        options_fail("--send value must be KEY,TYPE,VALUE");
+    type = strdup_up_to(send, ',');
+    send = strchr(send, ',') + 1;
+
+    if (!strcmp(type, "string"))
+        options_send_string(options, key, send);
+    else if (!strcmp(type, "integer"))
+        options_send_integer(options, key, atoi(send));
+    else
+        options_fail("--send TYPE must be 'string' or 'integer'");
+    free(key);
+    free(type);
+}
+
+struct options* parse_options(int argc, char* argv[])
+{
+    struct options* options = new_options();
+    int opt;
+    _Bool have_print = false;
+    while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            options->help = true;
+            break;
+        case 'l':
+            options_parse_line(options, optarg);
+            break;
+        case 'n':
+            free(options->namespace);
+            options->namespace = strdup(optarg);
+            break;
+        case 'p':
+            free(options->port);
+            options->port = strdup(optarg);
+            break;
+        case 'S':
+            if (options->session_init)
+                free(options->session_init);
+            options->session_init = strdup(optarg);
+            break;
+        case 'v':
+            options->verbose = true;
+            break;
+        case OPT_BENCH:
+            options_parse_bench(options, optarg);
+            break;
+        case OPT_BENCH_SESSIONS:
+            if (!strcmp(optarg, "reuse"))
+                options->bench_reuse_sessions = true;
+            else if (!strcmp(optarg, "clone"))
+                options->bench_reuse_sessions = false;
+            else
+                options_fail("--bench-sessions value must be 'clone' or 'reuse'");
+            break;
+        case OPT_DEBOUNCE:
+            options->debounce_ms = atol(optarg);
+            if (options->debounce_ms < 0)
+                options_fail("--debounce value must be a number of milliseconds");
+            break;
+        case OPT_IO:
+            if (!strcmp(optarg, "uring"))
+                options->io_uring = true;
+            else if (!strcmp(optarg, "poll"))
+                options->io_uring = false;
+            else
+                options_fail("--io value must be 'poll' or 'uring'");
+            break;
+        case OPT_JOBS:
+            options_parse_jobs(options, optarg);
+            break;
+        case OPT_JOBS_OUTPUT:
+            if (!strcmp(optarg, "ordered"))
+                options->jobs_labeled = false;
+            else if (!strcmp(optarg, "labeled"))
+                options->jobs_labeled = true;
+            else
+                options_fail("--jobs-output value must be 'ordered' or 'labeled'");
+            break;
+        case OPT_OP:
+            free(options->op);
+            options->op = strdup(optarg);
+            break;
+        case OPT_NO_PRINT:
+            remove_print_option(&options->print, optarg);
+            break;
+        case OPT_ON_EXCEPTION:
+            options_parse_on_exception(options, optarg);
+            break;
+        case OPT_OUTPUT_QUEUE:
+            options_parse_output_queue(options, optarg);
+            break;
+        case OPT_PRINT:
+            if (!have_print)
+            {
+                free_print_options(options->print);
+                options->print = NULL;
+                have_print = true;
+            }
+            append_print_option(&options->print, make_print_option(optarg));
+            break;
+        case OPT_PRINT_ROTATE:
+            print_target_rotate_size = parse_size(optarg, "--print-rotate value must be a size, e.g. 100m");
+            break;
+        case OPT_PRINT_BUFFER_SIZE:
+            options_send_integer(options, "nrepl.middleware.print/buffer-size",
+                (long long)parse_size(optarg, "--print-buffer-size value must be a size, e.g. 4k"));
+            break;
+        case OPT_PRINT_QUOTA:
+            options_send_integer(options, "nrepl.middleware.print/quota",
+                (long long)parse_size(optarg, "--print-quota value must be a size, e.g. 1m"));
+            break;
+        case OPT_PRINT_STREAM:
+            if (!options->print_stream)
+                options_send_integer(options, "nrepl.middleware.print/stream?", 1);
+            options->print_stream = true;
+            break;
+        case OPT_PRINTER:
+            options_send_string(options, "nrepl.middleware.print/print", optarg);
+            break;
+        case OPT_QUOTE:
+            options->quoting = find_quoting(optarg);
+            if (NULL == options->quoting)
+                options_fail("--quote value must be 'none', 'kakoune', or 'shell'");
+            break;
+        case OPT_RECORD:
+            if (options->record)
+                free(options->record);
+            options->record = strdup(optarg);
+            break;
+        case OPT_REPLAY:
+#if defined(_WIN32) || defined(WIN32)
+            options_fail("--replay is not supported on Windows");
+#endif
+            if (options->replay)
+                free(options->replay);
+            options->replay = strdup(optarg);
+            break;
+        case OPT_REPLAY_SPEED:
+            if (!strcmp(optarg, "max"))
+                options->replay_fast = true;
+            else if (!strcmp(optarg, "original"))
+                options->replay_fast = false;
+            else
+                options_fail("--replay-speed value must be 'original' or 'max'");
+            break;
+        case OPT_SEND:
+            options_parse_send(options, optarg);
+            break;
+        case OPT_SIDELOAD:
+#if defined(_WIN32) || defined(WIN32)
+            options_fail("--sideload is not supported on Windows");
+#endif
+            if (options->sideload)
+                free(options->sideload);
+            options->sideload = strdup(optarg);
+            break;
+        case OPT_SUPERSEDE:
+#if defined(_WIN32) || defined(WIN32)
+            options_fail("--supersede is not supported on Windows");
+#endif
+            if (options->supersede)
+                free(options->supersede);
+            options->supersede = strdup(optarg);
+            break;
+        case OPT_SYNC:
+            if (options->sync)
+                free(options->sync);
+            options->sync = strdup(optarg);
+            break;
+        case OPT_TAIL:
+#if defined(_WIN32) || defined(WIN32)
+            options_fail("--tail is not supported on Windows");
+#endif
+            options->tail = true;
+            break;
+        case OPT_WAIT:
+            options_parse_wait(options, optarg);
+            break;
+        case OPT_WATCH:
+#if defined(__linux__)
+            if (options->watch)
+                free(options->watch);
+            options->watch = strdup(optarg);
+#else
+            options_fail("--watch is only supported on Linux");
+#endif
+            break;
+        case '?':
+            exit(2);
+        }
+    }
+    options->code = collect_code(argc, argv, optind);
+    open_print_targets();
+    if (print_target_count > 0 && 0 == options->output_queue_size)
+        options->output_queue_size = 1024 * 1024;
+    return options;
+}
+
+void free_options(struct options* options)
+{
+    if (options->port)
+        free(options->port);
+    if (options->op)
+        free(options->op);
+    if (options->namespace)
+        free(options->namespace);
+    if (options->code)
+        free(options->code);
+    if (options->filename)
+        free(options->filename);
+    if (options->send)
+        free(options->send);
+    free_print_options(options->print);
+    if (options->session_init)
+        free(options->session_init);
+    if (options->watch)
+        free(options->watch);
+    if (options->sync)
+        free(options->sync);
+    if (options->on_exception_op)
+        free(options->on_exception_op);
+    if (options->sideload)
+        free(options->sideload);
+    if (options->supersede)
+        free(options->supersede);
+    if (options->record)
+        free(options->record);
+    if (options->replay)
+        free(options->replay);
+    free(options);
+}
+
+/* -- nrepl --------------------------------------------------------------- */
+
+#if !defined(_WIN32) && !defined(WIN32)
+struct sideloader;
+struct sideloader* make_sideloader(const char* paths);
+void free_sideloader(struct sideloader* sideloader);
+char* sideloader_provide_message(struct sideloader* sideloader, const char* session, const char* id, struct bvalue* lookup, size_t* length);
+#endif
+
+struct nrepl
+{
+    struct options* options;
+    int fd;
+    struct breader *decode;
+    _Bool exception_occurred;
+    _Bool value_open;
+    char* session;
+    struct output_queue* output;
+    struct sockaddr_in address;
+    struct bvalue* capture;
+#if defined(REP_IO_URING)
+    struct uring_stream* output_stream;
+#endif
+#if !defined(_WIN32) && !defined(WIN32)
+    struct sideloader* sideloader;
+#endif
+};
+
+/* With QUEUE_OUTPUT, and --output-queue or a --print file, printed output
+ * goes through a queue with its own writer thread.
+ */
+struct nrepl* make_nrepl(struct options* options, _Bool queue_output)
+{
+    struct nrepl* nrepl = (struct nrepl*)malloc(sizeof(struct nrepl));
+    nrepl->options = options;
+    nrepl->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (nrepl->fd == -1)
+        error("socket");
+    nrepl->decode = make_breader(nrepl->fd);
+    nrepl->exception_occurred = false;
+    nrepl->value_open = false;
+    nrepl->session = NULL;
+    nrepl->output = NULL;
+    nrepl->capture = NULL;
+#if defined(REP_IO_URING)
+    nrepl->output_stream = NULL;
+#endif
+#if !defined(_WIN32) && !defined(WIN32)
+    nrepl->sideloader = NULL;
+#endif
+    if (queue_output && options->output_queue_size > 0)
+        nrepl->output = make_output_queue(options->output_queue_size, options->output_policy);
+    return nrepl;
+}
+
+extern struct recording* nrepl_recording;
+
+void free_nrepl(struct nrepl* nrepl)
+{
+    if (nrepl->output)
+        free_output_queue(nrepl->output);
+    if (nrepl->decode && nrepl->decode->recording && 0 == --nrepl->decode->recording->users)
+    {
+        free_recording(nrepl->decode->recording);
+        nrepl_recording = NULL;
+    }
+    if (nrepl->fd >= 0)
+        close(nrepl->fd);
+    if (nrepl->decode)
+        free_breader(nrepl->decode);
+    if (nrepl->session)
+        free(nrepl->session);
+#if !defined(_WIN32) && !defined(WIN32)
+    if (nrepl->sideloader)
+        free_sideloader(nrepl->sideloader);
+#endif
+    free(nrepl);
+}
+
+void nrepl_output(struct nrepl* nrepl, int fd, const char* data, size_t size)
+{
+    if (nrepl->output)
+        output_queue_write(nrepl->output, fd, data, size);
+#if defined(REP_IO_URING)
+    else if (nrepl->output_stream)
+        uring_stream_append(nrepl->output_stream, fd, data, size);
+#endif
+    else
+        print_target_write(fd, data, size);
+}
+
+/* -v output goes through nrepl_output() too, so that it stays in order with
+ * the printed output, queued or not.
+ */
+void nrepl_verbose_message(struct nrepl* nrepl, const char* message, size_t length)
+{
+    struct bvalue* text = allocate_bvalue_bytestring(length + 5);
+    bvalue_append_string(&text, ">> ", 3);
+    bvalue_append_string(&text, message, length);
+    bvalue_append_string(&text, "\n", 1);
+    nrepl_output(nrepl, 1, text->value.bsvalue.data, text->value.bsvalue.size);
+    free_bvalue(text);
+}
+
+void nrepl_verbose_reply(struct nrepl* nrepl, struct bvalue* reply)
+{
+    struct bvalue* text = allocate_bvalue_bytestring(256);
+    bvalue_append_string(&text, "<< ", 3);
+    bvalue_append_dump(&text, reply, "<< ");
+    bvalue_append_string(&text, "\n", 1);
+    nrepl_output(nrepl, 1, text->value.bsvalue.data, text->value.bsvalue.size);
+    free_bvalue(text);
+}
+
+typedef void (*output_function)(void* context, int fd, const char* data, size_t size);
+
+void nrepl_output_function(void* nrepl, int fd, const char* data, size_t size)
+{
+    nrepl_output((struct nrepl*)nrepl, fd, data, size);
+}
+
+void nrepl_print_text(struct nrepl* nrepl, struct print_option* print, const char* data, size_t size, output_function output, void* context)
+{
+    if (print->fd < 0 && nrepl->capture)
+        bvalue_append_string(&nrepl->capture, data, size);
+    else if (size > 0)
+        output(context, print->fd, data, size);
+}
+
+void nrepl_print(struct nrepl* nrepl, struct print_option* print, struct bvalue* reply, const char* format, output_function output, void* context)
+{
+    struct bvalue* s = bvalue_format(reply, format, nrepl->options->quoting);
+    nrepl_print_text(nrepl, print, s->value.bsvalue.data, s->value.bsvalue.size, output, context);
+    free_bvalue(s);
+}
+
+/* With --print-stream, the server sends a value in chunks, each in a reply
+ * with only a `value`, and then the rest of the reply (with `ns`) without
+ * it.  The part of each value format before `%{value}` is printed before
+ * the first chunk, the chunks are printed as they arrive, and the rest of
+ * the format is printed when the value ends.  A reply with both `value` and
+ * `ns` is a whole value, as from servers without the print middleware.
+ */
+void nrepl_print_value_edge(struct nrepl* nrepl, struct bvalue* reply, _Bool suffix, output_function output, void* context)
+{
+    for (struct print_option* print = nrepl->options->print; print; print = print->next)
+    {
+        const char* split = strstr(print->format, "%{value}");
+        if (strcmp(print->key, "value") || NULL == split)
+            continue;
+        const struct quoting* quoting = nrepl->options->quoting;
+        if (suffix)
+        {
+            nrepl_print_text(nrepl, print, quoting->close, strlen(quoting->close), output, context);
+            nrepl_print(nrepl, print, reply, split + strlen("%{value}"), output, context);
+        }
+        else
+        {
+            char* prefix = strdup(print->format);
+            prefix[split - print->format] = '\0';
+            nrepl_print(nrepl, print, reply, prefix, output, context);
+            free(prefix);
+            nrepl_print_text(nrepl, print, quoting->open, strlen(quoting->open), output, context);
+        }
+    }
+}
+
+void nrepl_print_value_chunk(struct nrepl* nrepl, struct bvalue* chunk, output_function output, void* context)
+{
+    for (struct print_option* print = nrepl->options->print; print; print = print->next)
+    {
+        if (strcmp(print->key, "value") || NULL == strstr(print->format, "%{value}"))
+            continue;
+        if (NULL == nrepl->options->quoting->escaped)
+        {
+            nrepl_print_text(nrepl, print, chunk->value.bsvalue.data, chunk->value.bsvalue.size, output, context);
+            continue;
+        }
+        struct bvalue* s = allocate_bvalue_bytestring(chunk->value.bsvalue.size + 16);
+        bvalue_append_escaped(&s, nrepl->options->quoting, chunk->value.bsvalue.data, chunk->value.bsvalue.size);
+        nrepl_print_text(nrepl, print, s->value.bsvalue.data, s->value.bsvalue.size, output, context);
+        free_bvalue(s);
+    }
+}
+
+/* Prints REPLY through OUTPUT according to the print options, and notes new
+ * sessions and exceptions.  VALUE_OPEN tracks a streamed value between the
+ * replies to one request.  Returns true if REPLY finishes its request.
+ */
+_Bool nrepl_handle_reply(struct nrepl* nrepl, struct bvalue* reply, output_function output, void* context, _Bool* exception_occurred, _Bool* value_open)
+{
+    _Bool done = false;
+
+    struct bvalue* new_session = bvalue_dictionary_get(reply, "new-session");
+    if (new_session && BVALUE_BYTESTRING == new_session->type)
+    {
+        if (nrepl->session)
+            free(nrepl->session);
+        nrepl->session = strdup(new_session->value.bsvalue.data);
+    }
+
+    struct bvalue* value = bvalue_dictionary_get(reply, "value");
+    _Bool chunk = nrepl->options->print_stream && value && BVALUE_BYTESTRING == value->type &&
+        NULL == bvalue_dictionary_get(reply, "ns");
+    if (*value_open && !chunk)
+    {
+        nrepl_print_value_edge(nrepl, reply, true, output, context);
+        *value_open = false;
+    }
+    if (chunk)
+    {
+        if (!*value_open)
+            nrepl_print_value_edge(nrepl, reply, false, output, context);
+        *value_open = true;
+        nrepl_print_value_chunk(nrepl, value, output, context);
+    }
+
+    for (struct print_option* print = nrepl->options->print; print; print = print->next)
+    {
+        if (NULL == bvalue_dictionary_get(reply, print->key))
+            continue;
+        if (chunk && !strcmp(print->key, "value") && strstr(print->format, "%{value}"))
+            continue;
+        nrepl_print(nrepl, print, reply, print->format, output, context);
+    }
+
+    struct bvalue* ex = bvalue_dictionary_get(reply, "ex");
+    if (ex)
+        *exception_occurred = true;
+
+    if (bvalue_has_status(reply, "done"))
+        done = true;
+    if (bvalue_has_status(reply, "error"))
+        *exception_occurred = true;
+    if (bvalue_has_status(reply, "nrepl.middleware.print/truncated"))
+    {
+        static const char MESSAGE[] = "rep: the value was truncated by --print-quota\n";
+        output(context, 2, MESSAGE, strlen(MESSAGE));
+    }
+    if (bvalue_has_status(reply, "namespace-not-found"))
+    {
+        static const char MESSAGE[] = "the namespace does not exist\n";
+        output(context, 2, MESSAGE, strlen(MESSAGE));
+    }
+    if (bvalue_has_status(reply, "interrupted"))
+    {
+        static const char MESSAGE[] = "rep: the evaluation was interrupted\n";
+        output(context, 2, MESSAGE, strlen(MESSAGE));
+        *exception_occurred = true;
+    }
+    return done;
+}
+
+void nrepl_write_message(struct nrepl* nrepl, const char* message, size_t length);
+
+/* The sideloader's lookups, and the replies to sideloader-start and
+ * sideloader-provide, all carry this id and are handled here, whatever
+ * request is being waited for.
+ */
+const char SIDELOADER_ID[] = "rep-sideloader";
+
+_Bool nrepl_handle_sideloader_reply(struct nrepl* nrepl, struct bvalue* reply)
+{
+#if !defined(_WIN32) && !defined(WIN32)
+    struct bvalue* id = bvalue_dictionary_get(reply, "id");
+    if (NULL == nrepl->sideloader || NULL == id || BVALUE_BYTESTRING != id->type || strcmp(id->value.bsvalue.data, SIDELOADER_ID))
+        return false;
+    if (bvalue_has_status(reply, "unknown-op"))
+        fprintf(stderr, "rep: the server does not support the sideloader\n");
+    else if (bvalue_has_status(reply, "sideloader-lookup"))
+    {
+        size_t length;
+        char* message = sideloader_provide_message(nrepl->sideloader, nrepl->session, SIDELOADER_ID, reply, &length);
+        if (message)
+        {
+            nrepl_write_message(nrepl, message, length);
+            free(message);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct bvalue* nrepl_receive(struct nrepl* nrepl)
+{
+    for (;;)
+    {
+        struct bvalue* reply = breader_read(nrepl->decode);
+        if (nrepl->options->verbose)
+            nrepl_verbose_reply(nrepl, reply);
+        if (!nrepl_handle_sideloader_reply(nrepl, reply))
+            return reply;
+        free_bvalue(reply);
+    }
+}
+
+void nrepl_receive_until_done(struct nrepl* nrepl)
+{
+    _Bool done = false;
+    while (!done)
+    {
+        struct bvalue* reply = nrepl_receive(nrepl);
+        done = nrepl_handle_reply(nrepl, reply, nrepl_output_function, nrepl, &nrepl->exception_occurred, &nrepl->value_open);
+        free_bvalue(reply);
+    }
+}
+
+char* vformat_message(size_t* length, const char* format, va_list vargs)
+{
+    va_list copy;
+    va_copy(copy, vargs);
+    *length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+
+    char* message = (char*)malloc(*length + 1);
+    vsnprintf(message, *length + 1, format, vargs);
+    return message;
+}
+
+char* format_message(size_t* length, const char* format, ...)
+{
+    va_list vargs;
+    va_start(vargs, format);
+    char* message = vformat_message(length, format, vargs);
+    va_end(vargs);
+    return message;
+}
+
+/* Builds the request for the main operation described by OPTIONS. */
+char* options_op_message(struct options* options, const char* session, const char* code, const char* id, size_t* length)
+{
+    char extra_options[512] = "";
+    if (options->line != -1)
+        sprintf(extra_options + strlen(extra_options), "4:linei%de", options->line);
+    if (options->column != -1)
+        sprintf(extra_options + strlen(extra_options), "6:columni%de", options->column);
+    if (options->filename)
+        sprintf(extra_options + strlen(extra_options), "4:file%lu:%s", strlen(options->filename), options->filename);
+    if (id)
+        sprintf(extra_options + strlen(extra_options), "2:id%lu:%s", strlen(id), id);
+
+    return format_message(length, "d2:op%lu:%s2:ns%lu:%s7:session%lu:%s4:code%lu:%s%s%se",
+        strlen(options->op), options->op,
+        strlen(options->namespace), options->namespace,
+        strlen(session), session,
+        strlen(code), code,
+        options->send,
+        extra_options);
+}
+
+void nrepl_write_message(struct nrepl* nrepl, const char* message, size_t length)
+{
+    if (nrepl->options->verbose)
+        nrepl_verbose_message(nrepl, message, length);
+
+    if (send(nrepl->fd, message, length, 0) != length)
+        error("send");
+    recording_write(nrepl->decode->recording, '>', nrepl->decode->connection, message, length);
+}
+
+void nrepl_send_message(struct nrepl* nrepl, const char* message, size_t length)
+{
+    nrepl_write_message(nrepl, message, length);
+    nrepl_receive_until_done(nrepl);
+}
+
+void nrepl_send(struct nrepl* nrepl, const char* format, ...)
+{
+    va_list vargs;
+    size_t length;
+
+    va_start(vargs, format);
+    char* message = vformat_message(&length, format, vargs);
+    va_end(vargs);
+
+    nrepl_send_message(nrepl, message, length);
+    free(message);
+}
+
+/* Connections share one recording and one replay, and are numbered in the
+ * order they are made.
+ */
+struct recording* nrepl_recording = NULL;
+#if !defined(_WIN32) && !defined(WIN32)
+struct replay* nrepl_replay = NULL;
+#endif
+int nrepl_connection_count = 0;
+
+/* With --wait, waits for the port file to appear and retries refused
+ * connections, since the server may still be starting up.
+ */
+/* Connects, first waiting for the server as with --wait if WAIT is set. */
+void nrepl_connect_waiting(struct nrepl* nrepl, _Bool wait)
+{
+    struct options* options = nrepl->options;
+    int connection = nrepl_connection_count++;
+    if (options->record && !nrepl_recording)
+        nrepl_recording = make_recording(options->record);
+    if (nrepl_recording && !nrepl->decode->recording)
+        nrepl_recording->users++;
+    nrepl->decode->recording = nrepl_recording;
+    nrepl->decode->connection = connection;
+#if !defined(_WIN32) && !defined(WIN32)
+    if (options->replay)
+    {
+        if (!nrepl_replay)
+            nrepl_replay = load_replay(options->replay, options->replay_fast);
+        close(nrepl->fd);
+        nrepl->fd = nrepl->decode->fd = replay_connect(nrepl_replay, connection);
+        return;
+    }
+#endif
+
+    long long deadline = now_ms() + options->wait_timeout_ms;
+    long backoff_ms = 10;
+    for (;;)
+    {
+        long remaining_ms = -1;
+        if (wait && options->wait_timeout_ms >= 0)
+        {
+            remaining_ms = (long)(deadline - now_ms());
+            if (remaining_ms <= 0)
+                fail("rep: timed out waiting for nREPL server");
+        }
+        if (wait && !options_port_file_ready(options->port))
+        {
+            options_wait_for_port_file(options->port, remaining_ms);
+            continue;
+        }
+
+        nrepl->address = options_address(options, options->port);
+        if (0 == connect(nrepl->fd, (struct sockaddr*)&nrepl->address, sizeof(nrepl->address)))
+            return;
+#if defined(_WIN32) || defined(WIN32)
+        _Bool refused = WSAECONNREFUSED == WSAGetLastError();
+#else
+        _Bool refused = ECONNREFUSED == errno;
+#endif
+        if (!wait || !refused)
+            error("connect");
+
+        /* The state of a socket after a failed connect is unspecified. */
+        close(nrepl->fd);
+        nrepl->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (nrepl->fd == -1)
+            error("socket");
+        nrepl->decode->fd = nrepl->fd;
+        if (remaining_ms >= 0 && backoff_ms > remaining_ms)
+            backoff_ms = remaining_ms;
+        sleep_ms(backoff_ms);
+        if (backoff_ms < 250)
+            backoff_ms *= 2;
+    }
+}
+
+void nrepl_connect(struct nrepl* nrepl)
+{
+    nrepl_connect_waiting(nrepl, nrepl->options->wait);
+}
+
+/* Connects, clones a session, and runs any session initialization code. */
+int nrepl_open_session(struct nrepl* nrepl)
+{
+    nrepl_connect(nrepl);
+
+    nrepl_send(nrepl, "d2:op5:clonee");
+
+    if (nrepl->options->session_init)
+    {
+        struct print_option *original_print = nrepl->options->print;
+        nrepl->options->print = make_print_option("err,2,%{err}");
+
+        nrepl_send(nrepl, "d2:op4:eval7:session%lu:%s4:code%lu:%se",
+            strlen(nrepl->session), nrepl->session,
+            strlen(nrepl->options->session_init), nrepl->options->session_init);
+
+        free_print_options(nrepl->options->print);
+        nrepl->options->print = original_print;
+
+        if (nrepl->exception_occurred)
+            return 1;
+    }
+
+#if !defined(_WIN32) && !defined(WIN32)
+    if (nrepl->options->sideload)
+    {
+        if (!nrepl->sideloader)
+            nrepl->sideloader = make_sideloader(nrepl->options->sideload);
+        size_t length;
+        char* message = format_message(&length, "d2:op16:sideloader-start7:session%lu:%s2:id%lu:%se",
+            strlen(nrepl->session), nrepl->session,
+            strlen(SIDELOADER_ID), SIDELOADER_ID);
+        nrepl_write_message(nrepl, message, length);
+        free(message);
+    }
+#endif
+    return 0;
+}
+
+/* --on-exception=stacktrace evaluates this after the failed evaluation, so
+ * *e is the exception which was just thrown.
+ */
+const char ON_EXCEPTION_STACKTRACE_CODE[] = "(do (require 'clojure.repl) (clojure.repl/pst *e))";
+const char ON_EXCEPTION_ID[] = "rep-on-exception";
+
+void nrepl_send_exception_request(struct nrepl* nrepl)
+{
+    const char* op = nrepl->options->on_exception_op;
+    size_t length;
+    char* message;
+    if (op)
+        message = format_message(&length, "d2:op%lu:%s7:session%lu:%s2:id%lu:%se",
+            strlen(op), op,
+            strlen(nrepl->session), nrepl->session,
+            strlen(ON_EXCEPTION_ID), ON_EXCEPTION_ID);
+    else
+        message = format_message(&length, "d2:op4:eval7:session%lu:%s4:code%lu:%s2:id%lu:%se",
+            strlen(nrepl->session), nrepl->session,
+            strlen(ON_EXCEPTION_STACKTRACE_CODE), ON_EXCEPTION_STACKTRACE_CODE,
+            strlen(ON_EXCEPTION_ID), ON_EXCEPTION_ID);
+    nrepl_write_message(nrepl, message, length);
+    free(message);
+}
+
+/* With --on-exception, the details of an exception are requested on the
+ * same session before it is closed.  An eval queues behind the failed one on
+ * the session, so the stacktrace is requested as soon as `ex` arrives; other
+ * ops may run immediately, so they wait until the failed request is done.
+ * Replies are printed by the --print options, except for the stacktrace's
+ * value, which is just nil.
+ */
+void nrepl_receive_with_exception_details(struct nrepl* nrepl)
+{
+    struct print_option* print = nrepl->options->print;
+    struct print_option* stacktrace_print = copy_print_options(print);
+    remove_print_option(&stacktrace_print, "value");
+    _Bool wanted = false, requested = false, done = false, details_value_open = false;
+    int pending = 1;
+    while (pending > 0)
+    {
+        struct bvalue* reply = nrepl_receive(nrepl);
+        struct bvalue* id = bvalue_dictionary_get(reply, "id");
+        _Bool details = id && BVALUE_BYTESTRING == id->type && !strcmp(id->value.bsvalue.data, ON_EXCEPTION_ID);
+        if (details)
+        {
+            if (!nrepl->options->on_exception_op)
+                nrepl->options->print = stacktrace_print;
+            if (nrepl_handle_reply(nrepl, reply, nrepl_output_function, nrepl, &nrepl->exception_occurred, &details_value_open))
+                --pending;
+            nrepl->options->print = print;
+        }
+        else
+        {
+            if (bvalue_dictionary_get(reply, "ex"))
+                wanted = true;
+            if (nrepl_handle_reply(nrepl, reply, nrepl_output_function, nrepl, &nrepl->exception_occurred, &nrepl->value_open))
+            {
+                done = true;
+                --pending;
+            }
+        }
+        free_bvalue(reply);
+
+        if (wanted && !requested && (done || !nrepl->options->on_exception_op))
+        {
+            nrepl_send_exception_request(nrepl);
+            requested = true;
+            ++pending;
+        }
+    }
+    free_print_options(stacktrace_print);
+}
+
+#define SUPERSEDE_LOST -2
+
+int nrepl_supersede_acquire(struct nrepl* nrepl);
+void supersede_release(int fd);
+extern const char SUPERSEDE_ID[];
+
+void nrepl_send_op(struct nrepl* nrepl, const char* code)
+{
+    const char* id = NULL;
+#if !defined(_WIN32) && !defined(WIN32)
+    int supersede_fd = nrepl_supersede_acquire(nrepl);
+    if (SUPERSEDE_LOST == supersede_fd)
+    {
+        static const char MESSAGE[] = "rep: superseded by a newer evaluation\n";
+        nrepl_output(nrepl, 2, MESSAGE, strlen(MESSAGE));
+        nrepl->exception_occurred = true;
+        return;
+    }
+    if (-1 != supersede_fd)
+        id = SUPERSEDE_ID;
+#endif
+    size_t length;
+    char* message = options_op_message(nrepl->options, nrepl->session, code, id, &length);
+    if (nrepl->options->on_exception)
+    {
+        nrepl_write_message(nrepl, message, length);
+        nrepl_receive_with_exception_details(nrepl);
+    }
+    else
+        nrepl_send_message(nrepl, message, length);
+    free(message);
+#if !defined(_WIN32) && !defined(WIN32)
+    supersede_release(supersede_fd);
+#endif
+}
+
+void nrepl_close_session(struct nrepl* nrepl)
+{
+    nrepl_send(nrepl, "d2:op5:close7:session%lu:%se",
+        strlen(nrepl->session), nrepl->session);
+}
+
+_Bool is_clojure_source(const char* path)
+{
+    const char* extension = strrchr(path, '.');
+    return extension && (!strcmp(extension, ".clj") || !strcmp(extension, ".cljc"));
+}
+
+/* Returns false, and counts as an exception, if PATH can't be read. */
+_Bool nrepl_load_file(struct nrepl* nrepl, const char* path)
+{
+    size_t size = 0;
+    char* contents = slurp_file(path, &size);
+    if (NULL == contents)
+    {
+        perror(path);
+        nrepl->exception_occurred = true;
+        return false;
+    }
+    char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : (char*)path;
+    nrepl_send(nrepl, "d2:op9:load-file7:session%lu:%s4:file%lu:%s9:file-path%lu:%s9:file-name%lu:%se",
+        strlen(nrepl->session), nrepl->session,
+        size, contents,
+        strlen(path), path,
+        strlen(name), name);
+    free(contents);
+    return true;
+}
+
+int nrepl_exec(struct nrepl* nrepl)
+{
+    nrepl->exception_occurred = false;
+
+    if (nrepl_open_session(nrepl))
+        return 1;
+
+    nrepl_send_op(nrepl, nrepl->options->code);
+
+    nrepl_close_session(nrepl);
+
+    if (nrepl->exception_occurred)
+        return 1;
+    return 0;
+}
+
+/* -- sync ---------------------------------------------------------------- */
+
+/* --sync loads only the files which changed since the last successful sync
+ * with the same server.  Hashes of what was loaded are kept in a manifest
+ * named after the server's address and JVM, so that a restarted server gets
+ * everything again.
+ */
+
+uint64_t hash64_round(uint64_t hash, uint64_t word)
+{
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    word *= PRIME2;
+    word = (word << 31) | (word >> 33);
+    hash ^= word * PRIME1;
+    hash = (hash << 27) | (hash >> 37);
+    return hash * PRIME1 + 0x85EBCA77C2B2AE63ULL;
+}
+
+/* A fast, non-cryptographic 64-bit hash in the style of XXH64. */
+uint64_t hash64(const char* data, size_t size)
+{
+    uint64_t hash = 0x27D4EB2F165667C5ULL + size;
+    for (; size >= 8; data += 8, size -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        hash = hash64_round(hash, word);
+    }
+    if (size > 0)
+    {
+        uint64_t word = 0;
+        memcpy(&word, data, size);
+        hash = hash64_round(hash, word);
+    }
+    hash ^= hash >> 33;
+    hash *= 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    hash *= 0x165667B19E3779F9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+_Bool is_directory(const char* path)
+{
+#if defined(_WIN32) || defined(WIN32)
+    struct _stat statb;
+    return 0 == _stat(path, &statb) && (statb.st_mode & _S_IFDIR);
+#else
+    struct stat statb;
+    return 0 == stat(path, &statb) && S_ISDIR(statb.st_mode);
+#endif
+}
+
+_Bool make_directories(const char* path)
+{
+    char* copy = strdup(path);
+    for (char* p = copy + 1; ; p++)
+    {
+        if ('/' != *p && '\0' != *p)
+            continue;
+        char saved = *p;
+        *p = '\0';
+#if defined(_WIN32) || defined(WIN32)
+        (void)_mkdir(copy);
+#else
+        (void)mkdir(copy, 0777);
+#endif
+        *p = saved;
+        if (!saved)
+            break;
+    }
+    free(copy);
+    return is_directory(path);
+}
+
+struct sync_file
+{
+    char* path;
+    uint64_t hash;
+    int read_errno;
+    char* ns;
+    int require_count;
+    char** requires;
+    _Bool visited;
+    _Bool changed;
+    _Bool loaded;
+    _Bool failed;
+};
+
+struct sync
+{
+    int count;
+    struct sync_file* files;
+    int next_to_hash;
+    pthread_mutex_t lock;
+};
+
+void sync_collect_files(struct sync* sync, const char* directory)
+{
+    DIR* dir = opendir(directory);
+    if (NULL == dir)
+        error(directory);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if ('.' == entry->d_name[0])
+            continue;
+        char* path = (char*)malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", directory, entry->d_name);
+        if (is_directory(path))
+            sync_collect_files(sync, path);
+        else if (is_clojure_source(path))
+        {
+            sync->files = (struct sync_file*)realloc(sync->files, (sync->count + 1) * sizeof(struct sync_file));
+            memset(&sync->files[sync->count], 0, sizeof(struct sync_file));
+            sync->files[sync->count++].path = path;
+            continue;
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+int sync_compare_files(const void* a, const void* b)
+{
+    return strcmp(((const struct sync_file*)a)->path, ((const struct sync_file*)b)->path);
+}
+
+void* sync_hash_worker(void* arg)
+{
+    struct sync* sync = (struct sync*)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&sync->lock);
+        int i = sync->next_to_hash++;
+        pthread_mutex_unlock(&sync->lock);
+        if (i >= sync->count)
+            break;
+        size_t size = 0;
+        char* contents = slurp_file(sync->files[i].path, &size);
+        if (NULL == contents)
+        {
+            sync->files[i].read_errno = errno;
+            continue;
+        }
+        sync->files[i].hash = hash64(contents, size);
+        free(contents);
+    }
+    return NULL;
+}
+
+/* Hashes files on up to one thread per CPU, and at most 16, with at least
+ * 16 files for each thread so that small trees don't pay for threads.  A
+ * file which can't be read is reported once every thread has finished.
+ */
+void sync_hash_files(struct sync* sync)
+{
+    long thread_count = 4;
+#if defined(_SC_NPROCESSORS_ONLN)
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (thread_count > 1 + sync->count / 16)
+        thread_count = 1 + sync->count / 16;
+    if (thread_count > 16)
+        thread_count = 16;
+    pthread_t threads[16];
+    int started = 0;
+    for (; started < thread_count - 1; started++)
+        if (0 != pthread_create(&threads[started], NULL, sync_hash_worker, sync))
+            break;
+    sync_hash_worker(sync);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < sync->count; i++)
+        if (sync->files[i].read_errno)
+        {
+            errno = sync->files[i].read_errno;
+            error(sync->files[i].path);
+        }
+}
+
+/* Returns the path of the cache file for KEY under ~/.cache/rep/KIND,
+ * creating the directory, or NULL if there is no cache directory.
+ */
+char* cache_path(const char* kind, const char* key)
+{
+    const char* base = getenv("XDG_CACHE_HOME");
+    const char* suffix = "/rep/";
+    if (!base || !*base)
+    {
+        base = getenv("HOME");
+        suffix = "/.cache/rep/";
+    }
+    if (!base || !*base)
+        return NULL;
+    char* directory = (char*)malloc(strlen(base) + strlen(suffix) + strlen(kind) + 1);
+    sprintf(directory, "%s%s%s", base, suffix, kind);
+    if (!make_directories(directory))
+    {
+        free(directory);
+        return NULL;
+    }
+    char* path = (char*)malloc(strlen(directory) + 32);
+    sprintf(path, "%s/%016llx", directory, (unsigned long long)hash64(key, strlen(key)));
+    free(directory);
+    return path;
+}
+
+char* sync_manifest_path(const char* identity)
+{
+    char* path = cache_path("sync", identity);
+    if (NULL == path)
+        fail("rep: unable to create a cache directory under XDG_CACHE_HOME or HOME");
+    return path;
+}
+
+/* The manifest is a list of lines of the form "HASH PATH", which is indexed
+ * by path once, so that looking up every file of a large tree stays linear.
+ */
+struct manifest_entry
+{
+    const char* line;
+    size_t length;
+    uint64_t hash;
+    _Bool replaced;
+};
+
+struct manifest
+{
+    char* contents;
+    size_t count;
+    struct manifest_entry* entries;
+    size_t table_size;
+    size_t* table;
+};
+
+struct manifest* read_manifest(const char* path)
+{
+    struct manifest* manifest = (struct manifest*)malloc(sizeof(struct manifest));
+    memset(manifest, 0, sizeof(struct manifest));
+    size_t size = 0;
+    manifest->contents = slurp_file(path, &size);
+    size_t lines = 0;
+    for (size_t i = 0; i < size; i++)
+        if ('\n' == manifest->contents[i])
+            lines++;
+    manifest->entries = (struct manifest_entry*)malloc((lines + 1) * sizeof(struct manifest_entry));
+    for (const char* line = manifest->contents; line && *line; )
+    {
+        const char* end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+        if (end - line > 17 && ' ' == line[16])
+        {
+            struct manifest_entry* entry = &manifest->entries[manifest->count++];
+            entry->line = line;
+            entry->length = end - line;
+            entry->hash = strtoull(line, NULL, 16);
+            entry->replaced = false;
+        }
+        line = *end ? end + 1 : end;
+    }
+
+    manifest->table_size = 16;
+    while (manifest->table_size < 2 * manifest->count)
+        manifest->table_size *= 2;
+    manifest->table = (size_t*)calloc(manifest->table_size, sizeof(size_t));
+    for (size_t i = 0; i < manifest->count; i++)
+    {
+        struct manifest_entry* entry = &manifest->entries[i];
+        size_t slot = hash64(entry->line + 17, entry->length - 17) & (manifest->table_size - 1);
+        while (manifest->table[slot])
+            slot = (slot + 1) & (manifest->table_size - 1);
+        manifest->table[slot] = i + 1;
+    }
+    return manifest;
+}
+
+void free_manifest(struct manifest* manifest)
+{
+    free(manifest->contents);
+    free(manifest->entries);
+    free(manifest->table);
+    free(manifest);
+}
+
+struct manifest_entry* manifest_find(struct manifest* manifest, const char* path)
+{
+    size_t length = strlen(path);
+    size_t slot = hash64(path, length) & (manifest->table_size - 1);
+    for (; manifest->table[slot]; slot = (slot + 1) & (manifest->table_size - 1))
+    {
+        struct manifest_entry* entry = &manifest->entries[manifest->table[slot] - 1];
+        if (entry->length - 17 == length && !memcmp(entry->line + 17, path, length))
+            return entry;
+    }
+    return NULL;
+}
+
+void sync_write_manifest(const char* manifest_path, struct manifest* manifest, struct sync* sync)
+{
+    char* temporary_path = (char*)malloc(strlen(manifest_path) + 8);
+    sprintf(temporary_path, "%s.tmp", manifest_path);
+    FILE* out = fopen(temporary_path, "w");
+    if (NULL == out)
+        error(temporary_path);
+    /* A file which failed to load is dropped, so that it is loaded again
+     * even if it is put back as it was.  One which wasn't reached keeps its
+     * old entry, since the server still has that version.
+     */
+    for (int i = 0; i < sync->count; i++)
+    {
+        struct sync_file* file = &sync->files[i];
+        if (file->changed && !file->loaded && !file->failed)
+            continue;
+        if (!file->failed)
+            fprintf(out, "%016llx %s\n", (unsigned long long)file->hash, file->path);
+        struct manifest_entry* entry = manifest_find(manifest, file->path);
+        if (entry)
+            entry->replaced = true;
+    }
+
+    /* Keep entries for other directories synced to the same server. */
+    for (size_t i = 0; i < manifest->count; i++)
+        if (!manifest->entries[i].replaced)
+            fprintf(out, "%.*s\n", (int)manifest->entries[i].length, manifest->entries[i].line);
+    if (0 != fclose(out) || 0 != rename(temporary_path, manifest_path))
+        error(manifest_path);
+    free(temporary_path);
+}
+
+void sync_read_namespace(struct sync_file* file)
+{
+    size_t size = 0;
+    char* contents = slurp_file(file->path, &size);
+    if (NULL == contents)
+        error(file->path);
+    struct form_reader reader = { .p = contents, .end = contents + size };
+    struct form* form = form_read(&reader);
+    file->ns = form_ns_name(form);
+    if (file->ns)
+        file->require_count = form_ns_requires(form, &file->requires);
+    free_form(form);
+    free(contents);
+}
+
+/* Orders CHANGED so that each file comes after the changed files it
+ * requires.  Cycles are broken arbitrarily.
+ */
+void sync_visit(struct sync_file** changed, int changed_count, struct sync_file* file, struct sync_file** order, int* order_count)
+{
+    if (file->visited)
+        return;
+    file->visited = true;
+    for (int i = 0; i < file->require_count; i++)
+        for (int j = 0; j < changed_count; j++)
+            if (changed[j]->ns && !strcmp(changed[j]->ns, file->requires[i]))
+                sync_visit(changed, changed_count, changed[j], order, order_count);
+    order[(*order_count)++] = file;
+}
+
+char* nrepl_server_identity(struct nrepl* nrepl)
+{
+    static const char CODE[] =
+        "(let [b (java.lang.management.ManagementFactory/getRuntimeMXBean)]"
+        " (str (.getName b) \"@\" (.getStartTime b)))";
+    struct print_option* original_print = nrepl->options->print;
+    nrepl->options->print = make_print_option("value,-1,%{value}");
+    append_print_option(&nrepl->options->print, make_print_option("err,2,%{err}"));
+    nrepl->capture = allocate_bvalue_bytestring(64);
+    nrepl_send(nrepl, "d2:op4:eval7:session%lu:%s4:code%lu:%se",
+        strlen(nrepl->session), nrepl->session,
+        strlen(CODE), CODE);
+    free_print_options(nrepl->options->print);
+    nrepl->options->print = original_print;
+
+    char* identity = (char*)malloc(nrepl->capture->value.bsvalue.size + 64);
+    sprintf(identity, "%s:%d %.*s",
+        inet_ntoa(nrepl->address.sin_addr), ntohs(nrepl->address.sin_port),
+        (int)nrepl->capture->value.bsvalue.size, nrepl->capture->value.bsvalue.data);
+    free_bvalue(nrepl->capture);
+    nrepl->capture = NULL;
+    return identity;
+}
+
+int nrepl_sync(struct nrepl* nrepl)
+{
+    struct sync sync;
+    memset(&sync, 0, sizeof(sync));
+    pthread_mutex_init(&sync.lock, NULL);
+#if defined(_WIN32) || defined(WIN32)
+    char* directory = _fullpath(NULL, nrepl->options->sync, 0);
+#else
+    char* directory = realpath(nrepl->options->sync, NULL);
+#endif
+    if (NULL == directory)
+        error(nrepl->options->sync);
+    sync_collect_files(&sync, directory);
+    free(directory);
+    qsort(sync.files, sync.count, sizeof(struct sync_file), sync_compare_files);
+    sync_hash_files(&sync);
+
+    nrepl->exception_occurred = false;
+    if (nrepl_open_session(nrepl))
+        return 1;
+    char* identity = nrepl_server_identity(nrepl);
+    if (nrepl->exception_occurred)
+    {
+        nrepl_close_session(nrepl);
+        return 1;
+    }
+    char* manifest_path = sync_manifest_path(identity);
+    struct manifest* manifest = read_manifest(manifest_path);
+
+    struct sync_file** changed = (struct sync_file**)malloc((sync.count + 1) * sizeof(struct sync_file*));
+    struct sync_file** order = (struct sync_file**)malloc((sync.count + 1) * sizeof(struct sync_file*));
+    int changed_count = 0, order_count = 0;
+    for (int i = 0; i < sync.count; i++)
+    {
+        struct manifest_entry* entry = manifest_find(manifest, sync.files[i].path);
+        if (entry && entry->hash == sync.files[i].hash)
+            continue;
+        sync_read_namespace(&sync.files[i]);
+        sync.files[i].changed = true;
+        changed[changed_count++] = &sync.files[i];
+    }
+    for (int i = 0; i < changed_count; i++)
+        sync_visit(changed, changed_count, changed[i], order, &order_count);
+
+    /* Loading stops at the first file which throws.  The manifest records
+     * the files loaded before it, and never a hash for the file itself.
+     */
+    for (int i = 0; i < order_count && !nrepl->exception_occurred; i++)
+    {
+        nrepl_load_file(nrepl, order[i]->path);
+        if (nrepl->exception_occurred)
+            order[i]->failed = true;
+        else
+            order[i]->loaded = true;
+    }
+    if (changed_count > 0)
+        sync_write_manifest(manifest_path, manifest, &sync);
+
+    nrepl_close_session(nrepl);
+
+    for (int i = 0; i < sync.count; i++)
+    {
+        free(sync.files[i].path);
+        free(sync.files[i].ns);
+        for (int j = 0; j < sync.files[i].require_count; j++)
+            free(sync.files[i].requires[j]);
+        free(sync.files[i].requires);
+    }
+    free(sync.files);
+    free(changed);
+    free(order);
+    free_manifest(manifest);
+    free(manifest_path);
+    free(identity);
+    pthread_mutex_destroy(&sync.lock);
+    return nrepl->exception_occurred ? 1 : 0;
+}
+
+/* -- namespace ----------------------------------------------------------- */
+
+/* `-n @FILE` evaluates in the namespace declared by the first `ns` or
+ * `in-ns` form of FILE, or in `user` if there is none or FILE doesn't
+ * exist.  Editors ask for this on every evaluation, so the answer is cached
+ * under $XDG_CACHE_HOME/rep/ns (or ~/.cache/rep/ns) along with FILE's
+ * modification time and size.
+ */
+
+char* find_file_namespace(const char* path)
+{
+    size_t size = 0;
+    char* contents = slurp_file(path, &size);
+    if (NULL == contents)
+        return NULL;
+    struct form_reader reader = { .p = contents, .end = contents + size };
+    const char* extension = strrchr(path, '.');
+    if (extension && !strcmp(extension, ".cljs"))
+        reader.feature = ":cljs";
+    char* ns = NULL;
+    struct form* form;
+    while (!ns && (form = form_read(&reader)))
+    {
+        ns = form_current_ns(form);
+        free_form(form);
+    }
+    free(contents);
+    return ns;
+}
+
+/* Cache files hold three lines: the stamp, the file's path, and its
+ * namespace.
+ */
+char* namespace_cache_lookup(const char* cache_file, const char* stamp, const char* path)
+{
+    size_t size = 0;
+    char* contents = slurp_file(cache_file, &size);
+    if (NULL == contents)
+        return NULL;
+    char* ns = NULL;
+    size_t stamp_length = strlen(stamp), path_length = strlen(path);
+    if (size > stamp_length + path_length + 2 &&
+        !memcmp(contents, stamp, stamp_length) && '\n' == contents[stamp_length] &&
+        !memcmp(contents + stamp_length + 1, path, path_length) && '\n' == contents[stamp_length + 1 + path_length])
+        ns = strdup_up_to(contents + stamp_length + path_length + 2, '\n');
+    free(contents);
+    return ns;
+}
+
+void namespace_cache_store(const char* cache_file, const char* stamp, const char* path, const char* ns)
+{
+    char* temporary_path = (char*)malloc(strlen(cache_file) + 32);
+    sprintf(temporary_path, "%s.%d", cache_file, (int)getpid());
+    FILE* out = fopen(temporary_path, "w");
+    if (out)
+    {
+        fprintf(out, "%s\n%s\n%s\n", stamp, path, ns);
+        if (0 != fclose(out) || 0 != rename(temporary_path, cache_file))
+            remove(temporary_path);
+    }
+    free(temporary_path);
+}
+
+/* Replaces an `@FILE` namespace option with the namespace FILE declares. */
+void options_resolve_namespace(struct options* options)
+{
+    if ('@' != options->namespace[0])
+        return;
+    const char* filename = options->namespace + 1;
+    struct stat statb;
+    if (0 != stat(filename, &statb))
+    {
+        /* A new buffer which hasn't been saved yet. */
+        free(options->namespace);
+        options->namespace = strdup("user");
+        return;
+    }
+#if defined(_WIN32) || defined(WIN32)
+    char* path = _fullpath(NULL, filename, 0);
+    long nanoseconds = 0;
+#else
+    char* path = realpath(filename, NULL);
+#if defined(__APPLE__)
+    long nanoseconds = statb.st_mtimespec.tv_nsec;
+#else
+    long nanoseconds = statb.st_mtim.tv_nsec;
+#endif
+#endif
+    if (NULL == path)
+        error(filename);
+    char stamp[64];
+    sprintf(stamp, "%lld.%09ld %lld", (long long)statb.st_mtime, nanoseconds, (long long)statb.st_size);
+
+    char* cache_file = cache_path("ns", path);
+    char* ns = cache_file ? namespace_cache_lookup(cache_file, stamp, path) : NULL;
+    if (NULL == ns)
+    {
+        ns = find_file_namespace(path);
+        if (NULL == ns)
+            ns = strdup("user");
+        if (cache_file && !strchr(ns, '\n'))
+            namespace_cache_store(cache_file, stamp, path, ns);
+    }
+    if (options->verbose)
+        fprintf(stderr, "rep: %s is in namespace %s\n", filename, ns);
+
+    free(options->namespace);
+    options->namespace = ns;
+    if (cache_file)
+        free(cache_file);
+    free(path);
+}
+
+/* -- sideload ----------------------------------------------------------- */
+
+/* --sideload answers the server's sideloader lookups for classes and
+ * resources from local directories and jars.  Each jar is mapped into
+ * memory and its central directory indexed once, so a lookup is a hash
+ * probe, and a stored entry is base64-encoded straight from the mapping
+ * into the reply.  Deflated entries need zlib (build with REP_ZLIB=1).
+ */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+struct jar_entry
+{
+    const char* name;
+    size_t name_length;
+    unsigned method;
+    size_t compressed_size;
+    size_t size;
+    size_t offset;
+};
+
+struct sideload_path
+{
+    char* path;
+    _Bool is_jar;
+    const unsigned char* map;
+    size_t map_size;
+    struct jar_entry* entries;
+    size_t entry_count;
+    size_t* table;
+    size_t table_size;
+};
+
+struct sideloader
+{
+    struct sideload_path* paths;
+    int count;
+};
+
+unsigned read_le16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+size_t read_le32(const unsigned char* p)
+{
+    return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+}
+
+/* The table holds entry indices plus one, so that zero is an empty slot. */
+void sideload_index_entries(struct sideload_path* path)
+{
+    path->table_size = 16;
+    while (path->table_size < path->entry_count * 2)
+        path->table_size <<= 1;
+    path->table = (size_t*)calloc(path->table_size, sizeof(size_t));
+    for (size_t i = 0; i < path->entry_count; i++)
+    {
+        struct jar_entry* entry = &path->entries[i];
+        size_t slot = hash64(entry->name, entry->name_length) & (path->table_size - 1);
+        while (path->table[slot])
+            slot = (slot + 1) & (path->table_size - 1);
+        path->table[slot] = i + 1;
+    }
+}
+
+_Bool sideload_read_jar(struct sideload_path* path)
+{
+    const unsigned char* map = path->map;
+    size_t size = path->map_size;
+    if (size < 22)
+        return false;
+
+    const unsigned char* end_record = NULL;
+    size_t limit = size - 22 > 65535 ? size - 22 - 65535 : 0;
+    for (size_t at = size - 22; ; at--)
+    {
+        if (read_le32(map + at) == 0x06054b50)
+        {
+            end_record = map + at;
+            break;
+        }
+        if (at == limit)
+            return false;
+    }
+
+    size_t count = read_le16(end_record + 10);
+    size_t directory_size = read_le32(end_record + 12);
+    size_t directory_offset = read_le32(end_record + 16);
+    if (directory_offset + directory_size > size)
+        return false;
+
+    path->entries = (struct jar_entry*)malloc(sizeof(struct jar_entry) * (count ? count : 1));
+    const unsigned char* p = map + directory_offset;
+    const unsigned char* directory_end = p + directory_size;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (p + 46 > directory_end || read_le32(p) != 0x02014b50)
+            return false;
+        size_t name_length = read_le16(p + 28);
+        size_t extra_length = read_le16(p + 30);
+        size_t comment_length = read_le16(p + 32);
+        if (p + 46 + name_length > directory_end)
+            return false;
+        struct jar_entry* entry = &path->entries[path->entry_count];
+        entry->method = read_le16(p + 10);
+        entry->compressed_size = read_le32(p + 20);
+        entry->size = read_le32(p + 24);
+        entry->offset = read_le32(p + 42);
+        entry->name = (const char*)p + 46;
+        entry->name_length = name_length;
+        if (entry->offset + 30 <= size)
+            path->entry_count++;
+        p += 46 + name_length + extra_length + comment_length;
+    }
+    sideload_index_entries(path);
+    return true;
+}
+
+void sideload_open_jar(struct sideload_path* path)
+{
+    int fd = open(path->path, O_RDONLY);
+    if (-1 == fd)
+    {
+        perror(path->path);
+        return;
+    }
+    struct stat st;
+    if (-1 == fstat(fd, &st) || 0 == st.st_size)
+    {
+        close(fd);
+        return;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+    {
+        perror(path->path);
+        return;
+    }
+    path->map = (const unsigned char*)map;
+    path->map_size = st.st_size;
+    if (!sideload_read_jar(path))
+        fprintf(stderr, "rep: %s: not a jar file\n", path->path);
+}
+
+struct sideloader* make_sideloader(const char* paths)
+{
+    struct sideloader* sideloader = (struct sideloader*)malloc(sizeof(struct sideloader));
+    sideloader->count = 1;
+    for (const char* p = paths; *p; p++)
+        if (':' == *p)
+            sideloader->count++;
+    sideloader->paths = (struct sideload_path*)calloc(sideloader->count, sizeof(struct sideload_path));
+
+    const char* p = paths;
+    for (int i = 0; i < sideloader->count; i++)
+    {
+        struct sideload_path* path = &sideloader->paths[i];
+        path->path = strdup_up_to(p, ':');
+        p += strlen(path->path) + 1;
+        struct stat st;
+        if (-1 == stat(path->path, &st))
+            perror(path->path);
+        else if (!S_ISDIR(st.st_mode))
+        {
+            path->is_jar = true;
+            sideload_open_jar(path);
+        }
+    }
+    return sideloader;
+}
+
+void free_sideloader(struct sideloader* sideloader)
+{
+    for (int i = 0; i < sideloader->count; i++)
+    {
+        struct sideload_path* path = &sideloader->paths[i];
+        free(path->path);
+        if (path->map)
+            munmap((void*)path->map, path->map_size);
+        if (path->entries)
+            free(path->entries);
+        if (path->table)
+            free(path->table);
+    }
+    free(sideloader->paths);
+    free(sideloader);
+}
+
+struct jar_entry* sideload_find_entry(struct sideload_path* path, const char* name, size_t length)
+{
+    if (NULL == path->table)
+        return NULL;
+    size_t slot = hash64(name, length) & (path->table_size - 1);
+    for (; path->table[slot]; slot = (slot + 1) & (path->table_size - 1))
+    {
+        struct jar_entry* entry = &path->entries[path->table[slot] - 1];
+        if (entry->name_length == length && !memcmp(entry->name, name, length))
+            return entry;
+    }
+    return NULL;
+}
+
+/* Returns the contents of ENTRY, either pointing into the mapping or, if
+ * *ALLOCATED is set, in a malloc()ed buffer.
+ */
+const unsigned char* sideload_entry_data(struct sideload_path* path, struct jar_entry* entry, size_t* size, _Bool* allocated)
+{
+    const unsigned char* local = path->map + entry->offset;
+    if (read_le32(local) != 0x04034b50)
+        return NULL;
+    size_t data_offset = entry->offset + 30 + read_le16(local + 26) + read_le16(local + 28);
+    if (data_offset + entry->compressed_size > path->map_size)
+        return NULL;
+    const unsigned char* data = path->map + data_offset;
+
+    *allocated = false;
+    if (0 == entry->method)
+    {
+        *size = entry->compressed_size;
+        return data;
+    }
+#if defined(REP_ZLIB)
+    if (8 == entry->method)
+    {
+        unsigned char* inflated = (unsigned char*)malloc(entry->size ? entry->size : 1);
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (Z_OK != inflateInit2(&stream, -MAX_WBITS))
+        {
+            free(inflated);
+            return NULL;
+        }
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = entry->compressed_size;
+        stream.next_out = inflated;
+        stream.avail_out = entry->size;
+        int result = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        if (Z_STREAM_END != result)
+        {
+            free(inflated);
+            return NULL;
+        }
+        *size = entry->size;
+        *allocated = true;
+        return inflated;
+    }
+#endif
+    fprintf(stderr, "rep: %s: %.*s is compressed, which needs a build with REP_ZLIB=1\n",
+        path->path, (int)entry->name_length, entry->name);
+    return NULL;
+}
+
+/* The server sends names from anywhere, so refuse to leave PATH. */
+_Bool sideload_name_is_safe(const char* name)
+{
+    if ('/' == *name)
+        return false;
+    for (const char* p = name; *p; p = strchr(p, '/') ? strchr(p, '/') + 1 : p + strlen(p))
+        if (!strncmp(p, "..", 2) && ('/' == p[2] || '\0' == p[2]))
+            return false;
+    return true;
+}
+
+const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_length(size_t size)
+{
+    return (size + 2) / 3 * 4;
+}
+
+void base64_encode(char* out, const unsigned char* data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        uint32_t word = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *out++ = BASE64_DIGITS[word >> 18];
+        *out++ = BASE64_DIGITS[(word >> 12) & 63];
+        *out++ = BASE64_DIGITS[(word >> 6) & 63];
+        *out++ = BASE64_DIGITS[word & 63];
+    }
+    if (i < size)
+    {
+        uint32_t word = data[i] << 16;
+        if (i + 1 < size)
+            word |= data[i + 1] << 8;
+        *out++ = BASE64_DIGITS[word >> 18];
+        *out++ = BASE64_DIGITS[(word >> 12) & 63];
+        *out++ = i + 1 < size ? BASE64_DIGITS[(word >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+}
+
+/* Builds the sideloader-provide message answering LOOKUP, with empty
+ * content if nothing on the path has the class or resource.
+ */
+char* sideloader_provide_message(struct sideloader* sideloader, const char* session, const char* id, struct bvalue* lookup, size_t* length)
+{
+    struct bvalue* type = bvalue_dictionary_get(lookup, "type");
+    struct bvalue* name = bvalue_dictionary_get(lookup, "name");
+    if (NULL == type || BVALUE_BYTESTRING != type->type || NULL == name || BVALUE_BYTESTRING != name->type)
+        return NULL;
+
+    char* resource;
+    if (!strcmp(type->value.bsvalue.data, "class"))
+    {
+        resource = (char*)malloc(name->value.bsvalue.size + 7);
+        strcpy(resource, name->value.bsvalue.data);
+        for (char* p = resource; *p; p++)
+            if ('.' == *p)
+                *p = '/';
+        strcat(resource, ".class");
+    }
+    else
+        resource = strdup(name->value.bsvalue.data);
+
+    const unsigned char* data = NULL;
+    size_t size = 0;
+    _Bool allocated = false;
+    _Bool mapped = false;
+    for (int i = 0; NULL == data && sideload_name_is_safe(resource) && i < sideloader->count; i++)
+    {
+        struct sideload_path* path = &sideloader->paths[i];
+        if (path->is_jar)
+        {
+            struct jar_entry* entry = sideload_find_entry(path, resource, strlen(resource));
+            if (entry)
+                data = sideload_entry_data(path, entry, &size, &allocated);
+            continue;
+        }
+
+        char* file_name = (char*)malloc(strlen(path->path) + strlen(resource) + 2);
+        sprintf(file_name, "%s/%s", path->path, resource);
+        int fd = open(file_name, O_RDONLY);
+        free(file_name);
+        if (-1 == fd)
+            continue;
+        struct stat st;
+        if (0 == fstat(fd, &st) && S_ISREG(st.st_mode))
+        {
+            size = st.st_size;
+            if (0 == size)
+                data = (const unsigned char*)"";
+            else
+            {
+                void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (MAP_FAILED != map)
+                {
+                    data = (const unsigned char*)map;
+                    mapped = true;
+                }
+            }
+        }
+        close(fd);
+    }
+    free(resource);
+    if (NULL == data)
+        size = 0;
+
+    size_t header_length;
+    char* header = format_message(&header_length, "d2:op18:sideloader-provide7:session%lu:%s2:id%lu:%s4:type%lu:%s4:name%lu:%s7:content%lu:",
+        strlen(session), session,
+        strlen(id), id,
+        type->value.bsvalue.size, type->value.bsvalue.data,
+        name->value.bsvalue.size, name->value.bsvalue.data,
+        base64_length(size));
+    *length = header_length + base64_length(size) + 1;
+    char* message = (char*)malloc(*length + 1);
+    memcpy(message, header, header_length);
+    free(header);
+    base64_encode(message + header_length, data, size);
+    message[*length - 1] = 'e';
+    message[*length] = '\0';
+
+    if (mapped)
+        munmap((void*)data, size);
+    if (allocated)
+        free((void*)data);
+    return message;
+}
+
+#endif
+
+/* -- supersede ----------------------------------------------------------- */
+
+/* --supersede=KEY lets the newest invocation with KEY win.  While its request
+ * is in flight, rep holds an exclusive lock on a file for KEY under
+ * XDG_RUNTIME_DIR which names the request's session and id.  A newer rep
+ * which can't take the lock interrupts that request, then waits for the
+ * older rep to finish and let go.  The lock dies with its process, so a
+ * crashed rep never leaves a stale entry behind.
+ *
+ * Several reps may be waiting at once, so each first bumps a generation
+ * counter kept beside the lock file.  A rep which sees a generation newer
+ * than its own, while waiting or once it has the lock, gives up without
+ * sending anything.
+ */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+const char SUPERSEDE_ID[] = "rep-supersede";
+const char SUPERSEDE_INTERRUPT_ID[] = "rep-supersede-interrupt";
+
+/* Returns the registry file for KEY, creating its directory, or NULL if
+ * there is no directory which only we can use.
+ */
+char* supersede_path(const char* key)
+{
+    const char* base = getenv("XDG_RUNTIME_DIR");
+    char* directory = (char*)malloc((base ? strlen(base) : 0) + 32);
+    if (base && *base)
+        sprintf(directory, "%s/rep", base);
+    else
+        sprintf(directory, "/tmp/rep-%lu", (unsigned long)getuid());
+    struct stat statb;
+    if ((-1 == mkdir(directory, 0700) && EEXIST != errno) ||
+        0 != lstat(directory, &statb) ||
+        !S_ISDIR(statb.st_mode) ||
+        statb.st_uid != getuid() ||
+        0 != (statb.st_mode & 077))
+    {
+        free(directory);
+        return NULL;
+    }
+    char* path = (char*)malloc(strlen(directory) + 48);
+    sprintf(path, "%s/supersede-%016llx", directory, (unsigned long long)hash64(key, strlen(key)));
+    free(directory);
+    return path;
+}
+
+unsigned long long supersede_read_generation(int fd)
+{
+    unsigned long long generation = 0;
+    if ((ssize_t)sizeof(generation) != pread(fd, &generation, sizeof(generation), 0))
+        return 0;
+    return generation;
+}
+
+/* Bumps the generation in FD, returning our own. */
+unsigned long long supersede_take_generation(int fd)
+{
+    while (-1 == flock(fd, LOCK_EX) && EINTR == errno)
+        ;
+    unsigned long long generation = supersede_read_generation(fd) + 1;
+    if ((ssize_t)sizeof(generation) != pwrite(fd, &generation, sizeof(generation), 0))
+        error("supersede");
+    flock(fd, LOCK_UN);
+    return generation;
+}
+
+/* Reads the "SESSION ID" entry left by the holder of the lock on FD.
+ * Returns false if the holder hasn't written a whole entry yet.
+ */
+_Bool supersede_read_entry(int fd, char* entry, size_t size)
+{
+    ssize_t count = pread(fd, entry, size - 1, 0);
+    if (count <= 0 || '\n' != entry[count - 1])
+        return false;
+    entry[count - 1] = '\0';
+    return NULL != strchr(entry, ' ');
+}
+
+/* Interrupts the request named by ENTRY and waits for the server's answer.
+ * Returns false if there was nothing to interrupt yet, because the older
+ * request hasn't reached the server or has already finished.
+ */
+_Bool nrepl_supersede_interrupt(struct nrepl* nrepl, const char* entry)
+{
+    const char* space = strchr(entry, ' ');
+    size_t length;
+    char* message = format_message(&length, "d2:op9:interrupt7:session%lu:%.*s12:interrupt-id%lu:%s2:id%lu:%se",
+        (unsigned long)(space - entry), (int)(space - entry), entry,
+        strlen(space + 1), space + 1,
+        strlen(SUPERSEDE_INTERRUPT_ID), SUPERSEDE_INTERRUPT_ID);
+    nrepl_write_message(nrepl, message, length);
+    free(message);
+
+    _Bool interrupted = true;
+    _Bool done = false;
+    while (!done)
+    {
+        struct bvalue* reply = nrepl_receive(nrepl);
+        struct bvalue* id = bvalue_dictionary_get(reply, "id");
+        if (id && BVALUE_BYTESTRING == id->type && !strcmp(id->value.bsvalue.data, SUPERSEDE_INTERRUPT_ID))
+        {
+            if (bvalue_has_status(reply, "session-idle") || bvalue_has_status(reply, "interrupt-id-mismatch"))
+                interrupted = false;
+            done = bvalue_has_status(reply, "done");
+        }
+        free_bvalue(reply);
+    }
+    return interrupted;
+}
+
+/* Takes the lock for --supersede's key, interrupting whichever request
+ * holds it, and records our own.  Returns the locked file, -1 without
+ * --supersede, or SUPERSEDE_LOST if a newer rep with the key came along
+ * while we were waiting.
+ */
+int nrepl_supersede_acquire(struct nrepl* nrepl)
+{
+    if (NULL == nrepl->options->supersede)
+        return -1;
+    char* path = supersede_path(nrepl->options->supersede);
+    if (NULL == path)
+        fail("rep: unable to create a private runtime directory under XDG_RUNTIME_DIR or /tmp");
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (-1 == fd)
+        error(path);
+    char* generation_path = (char*)malloc(strlen(path) + 16);
+    sprintf(generation_path, "%s.generation", path);
+    int generation_fd = open(generation_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (-1 == generation_fd)
+        error(generation_path);
+    free(generation_path);
+    free(path);
+    unsigned long long generation = supersede_take_generation(generation_fd);
+
+    char entry[512];
+    char interrupted[512] = "";
+    _Bool lost = false;
+    for (;;)
+    {
+        _Bool locked = 0 == flock(fd, LOCK_EX | LOCK_NB);
+        if (!locked && EWOULDBLOCK != errno && EINTR != errno)
+            error("flock");
+        if (supersede_read_generation(generation_fd) != generation)
+        {
+            lost = true;
+            break;
+        }
+        if (locked)
+            break;
+        if (supersede_read_entry(fd, entry, sizeof(entry)) && strcmp(entry, interrupted))
+        {
+            if (nrepl_supersede_interrupt(nrepl, entry))
+                strcpy(interrupted, entry);
+        }
+        sleep_ms(10);
+    }
+    close(generation_fd);
+    if (lost)
+    {
+        close(fd);
+        return SUPERSEDE_LOST;
+    }
+
+    size_t length;
+    char* own = format_message(&length, "%s %s\n", nrepl->session, SUPERSEDE_ID);
+    if (-1 == ftruncate(fd, 0) || (ssize_t)length != pwrite(fd, own, length, 0))
+        error("supersede");
+    free(own);
+    return fd;
+}
+
+void supersede_release(int fd)
+{
+    if (-1 == fd)
+        return;
+    (void)ftruncate(fd, 0);
+    close(fd);
+}
+
+#endif
+
+/* -- async --------------------------------------------------------------- */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+/* --bench and --jobs drive all of their connections from one poll() loop, or
+ * one io_uring, so that the client adds as little latency as possible.
+ * Requests are queued on a connection and written as its socket accepts
+ * them, and each complete reply is passed to a callback.
+ */
+
+struct async_connection
+{
+    struct nrepl* nrepl;
+    /* The first connection, which all output goes through. */
+    struct nrepl* output;
+    _Bool finished;
+    char* pending;
+    size_t pending_length;
+    size_t pending_sent;
+    size_t pending_allocated;
+#if defined(REP_IO_URING)
+    struct uring_stream sending;
+    _Bool receiving;
+    _Bool received;
+#endif
+    void* data;
+};
+
+#if defined(REP_IO_URING)
+struct uring* async_uring = NULL;
+_Bool async_uring_tried = false;
+#endif
+
+const char* async_backend(void)
+{
+#if defined(REP_IO_URING)
+    if (async_uring)
+        return "uring";
+#endif
+    return "poll";
+}
+
+typedef void (*async_reply_function)(void* context, struct async_connection* connection, struct bvalue* reply);
+
+/* Only the first connection, OUTPUT being NULL, gets an output queue. */
+void async_open(struct async_connection* connection, struct options* options, struct nrepl* output)
+{
+    memset(connection, 0, sizeof(*connection));
+    connection->nrepl = make_nrepl(options, NULL == output);
+    connection->output = output ? output : connection->nrepl;
+    nrepl_connect(connection->nrepl);
+    int one = 1;
+    setsockopt(connection->nrepl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(connection->nrepl->fd, F_SETFL, fcntl(connection->nrepl->fd, F_GETFL) | O_NONBLOCK);
+#if defined(REP_IO_URING)
+    connection->sending.socket = true;
+    if (options->io_uring && !async_uring_tried)
+    {
+        async_uring_tried = true;
+        async_uring = make_uring(256);
+        if (NULL == async_uring && options->verbose)
+            fprintf(stderr, "rep: io_uring is not available, using poll()\n");
+    }
+#endif
+}
+
+void async_close(struct async_connection* connection)
+{
+    free_nrepl(connection->nrepl);
+    if (connection->pending)
+        free(connection->pending);
+#if defined(REP_IO_URING)
+    free_uring_stream(&connection->sending);
+#endif
+}
+
+/* Servers which write a reply in several segments would otherwise wait for
+ * our delayed ACK under Nagle's algorithm.  Sending a request puts the
+ * socket back into delayed ACK mode, so quick ACKs are asked for again once
+ * per request sent, rather than after every receive.
+ */
+void async_quickack(struct async_connection* connection)
+{
+#if defined(TCP_QUICKACK)
+    int one = 1;
+    setsockopt(connection->nrepl->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#else
+    (void)connection;
+#endif
+}
+
+void async_flush(struct async_connection* connection)
+{
+    while (connection->pending_sent < connection->pending_length)
+    {
+        ssize_t count = send(connection->nrepl->fd,
+            connection->pending + connection->pending_sent,
+            connection->pending_length - connection->pending_sent, MSG_NOSIGNAL);
+        if (count < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return;
+        if (count < 0 && EINTR == errno)
+            continue;
+        if (count < 0)
+            error("send");
+        recording_write(connection->nrepl->decode->recording, '>', connection->nrepl->decode->connection,
+            connection->pending + connection->pending_sent, count);
+        connection->pending_sent += count;
+    }
+    if (connection->pending_length > 0)
+        async_quickack(connection);
+    connection->pending_length = 0;
+    connection->pending_sent = 0;
+}
+
+/* Queues MESSAGE, which is freed, to be sent on CONNECTION. */
+void async_send(struct async_connection* connection, char* message, size_t length)
+{
+    if (connection->nrepl->options->verbose)
+        nrepl_verbose_message(connection->output, message, length);
+#if defined(REP_IO_URING)
+    if (async_uring)
+    {
+        uring_stream_append(&connection->sending, connection->nrepl->fd, message, length);
+        free(message);
+        return;
+    }
+#endif
+    if (connection->pending_length + length > connection->pending_allocated)
+    {
+        connection->pending_allocated = connection->pending_length + length + 1024;
+        connection->pending = (char*)realloc(connection->pending, connection->pending_allocated);
+    }
+    memcpy(connection->pending + connection->pending_length, message, length);
+    connection->pending_length += length;
+    free(message);
+    async_flush(connection);
+}
+
+#if defined(REP_IO_URING)
+
+enum async_operation
+{
+    ASYNC_RECEIVE,
+    ASYNC_SEND,
+    ASYNC_OUTPUT,
+    ASYNC_CANCEL
+};
+
+#define ASYNC_USER_DATA(index, operation) (((uint64_t)(index) << 2) | (operation))
+
+void async_uring_receive(struct uring* uring, struct async_connection* connection, int index)
+{
+    if (connection->receiving)
+        return;
+    struct io_uring_sqe* sqe = uring_get_sqe(uring, ASYNC_USER_DATA(index, ASYNC_RECEIVE));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->nrepl->fd;
+#if defined(IORING_RECV_MULTISHOT)
+    if (uring->multishot)
+    {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        connection->receiving = true;
+        return;
+    }
+#endif
+    size_t space;
+    sqe->addr = (uintptr_t)breader_reserve(connection->nrepl->decode, &space);
+    sqe->len = space;
+    connection->receiving = true;
+}
+
+void async_uring_complete(struct uring* uring, struct async_connection* connections, struct uring_stream* output, struct io_uring_cqe* cqe)
+{
+    struct async_connection* connection = &connections[cqe->user_data >> 2];
+    const char* data;
+    int result;
+    switch (cqe->user_data & 3)
+    {
+    case ASYNC_RECEIVE:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            connection->receiving = false;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0 && !connection->finished)
+                breader_append(connection->nrepl->decode, uring_buffer(uring, bid), cqe->res);
+            uring_recycle_buffer(uring, bid);
+        }
+        else if (cqe->res > 0 && !connection->finished)
+            breader_commit(connection->nrepl->decode, cqe->res);
+        if (cqe->res > 0)
+            connection->received = true;
+        else if (0 == cqe->res && !connection->finished)
+            fail("rep: the nREPL server closed the connection");
+        else if (-EINVAL == cqe->res && uring->multishot)
+            uring->multishot = false;
+        else if (cqe->res < 0 && -ECANCELED != cqe->res && -ENOBUFS != cqe->res && -EINTR != cqe->res)
+        {
+            errno = -cqe->res;
+            error("recv");
+        }
+        break;
+    case ASYNC_SEND:
+        result = uring_stream_complete(&connection->sending, cqe->res, &data);
+        if (result < 0)
+        {
+            errno = -result;
+            error("send");
+        }
+        recording_write(connection->nrepl->decode->recording, '>', connection->nrepl->decode->connection, data, result);
+        async_quickack(connection);
+        break;
+    case ASYNC_OUTPUT:
+        uring_stream_complete(output, cqe->res, &data);
+        break;
+    default:
+        break;
+    }
+}
+
+void async_run_uring(struct uring* uring, struct async_connection* connections, int count, async_reply_function on_reply, void* context)
+{
+    struct uring_stream output;
+    memset(&output, 0, sizeof(output));
+    for (int i = 0; i < count; i++)
+        connections[i].nrepl->output_stream = &output;
+
+    for (;;)
+    {
+        int active = 0;
+        for (int i = 0; i < count; i++)
+        {
+            struct async_connection* connection = &connections[i];
+            if (!connection->finished)
+                async_uring_receive(uring, connection, i);
+            uring_stream_submit(uring, &connection->sending, ASYNC_USER_DATA(i, ASYNC_SEND));
+            if (!connection->finished || uring_stream_busy(&connection->sending))
+                active++;
+        }
+        uring_stream_submit(uring, &output, ASYNC_USER_DATA(0, ASYNC_OUTPUT));
+        if (0 == active && !uring_stream_busy(&output))
+            break;
+
+        uring_submit_and_wait(uring);
+        struct io_uring_cqe cqe;
+        while (uring_next_completion(uring, &cqe))
+            async_uring_complete(uring, connections, &output, &cqe);
+
+        for (int i = 0; i < count; i++)
+        {
+            struct async_connection* connection = &connections[i];
+            if (!connection->received)
+                continue;
+            connection->received = false;
+            while (!connection->finished && breader_has_value(connection->nrepl->decode))
+            {
+                struct bvalue* reply = breader_read(connection->nrepl->decode);
+                on_reply(context, connection, reply);
+                free_bvalue(reply);
+            }
+        }
+    }
+
+    /* Receives still in flight write into our buffers, so cancel them
+     * before anything is freed.
+     */
+    _Bool receiving = false;
+    for (int i = 0; i < count; i++)
+    {
+        if (!connections[i].receiving)
+            continue;
+        struct io_uring_sqe* sqe = uring_get_sqe(uring, ASYNC_USER_DATA(i, ASYNC_CANCEL));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ASYNC_USER_DATA(i, ASYNC_RECEIVE);
+        receiving = true;
+    }
+    while (receiving)
+    {
+        uring_submit_and_wait(uring);
+        struct io_uring_cqe cqe;
+        while (uring_next_completion(uring, &cqe))
+            async_uring_complete(uring, connections, &output, &cqe);
+        receiving = false;
+        for (int i = 0; i < count; i++)
+            if (connections[i].receiving)
+                receiving = true;
+    }
+
+    for (int i = 0; i < count; i++)
+        connections[i].nrepl->output_stream = NULL;
+    free_uring_stream(&output);
+}
+
+#endif
+
+/* Runs until every connection is finished. */
+void async_run(struct async_connection* connections, int count, async_reply_function on_reply, void* context)
+{
+#if defined(REP_IO_URING)
+    if (async_uring)
+    {
+        async_run_uring(async_uring, connections, count, on_reply, context);
+        free_uring(async_uring);
+        async_uring = NULL;
+        return;
+    }
+#endif
+    struct pollfd* pfds = (struct pollfd*)calloc(count, sizeof(struct pollfd));
+    for (;;)
+    {
+        int active = 0;
+        for (int i = 0; i < count; i++)
+        {
+            pfds[i].fd = connections[i].finished ? -1 : connections[i].nrepl->fd;
+            pfds[i].events = POLLIN | (connections[i].pending_length ? POLLOUT : 0);
+            pfds[i].revents = 0;
+            if (!connections[i].finished)
+                active++;
+        }
+        if (0 == active)
+            break;
+        if (poll(pfds, count, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            error("poll");
+        }
+        for (int i = 0; i < count; i++)
+        {
+            struct async_connection* connection = &connections[i];
+            if (pfds[i].revents & POLLOUT)
+                async_flush(connection);
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t received = breader_fill(connection->nrepl->decode);
+            if (0 == received)
+                fail("rep: the nREPL server closed the connection");
+            if (received < 0 && EAGAIN != errno && EWOULDBLOCK != errno)
+                error("recv");
+            while (!connection->finished && breader_has_value(connection->nrepl->decode))
+            {
+                struct bvalue* reply = breader_read(connection->nrepl->decode);
+                on_reply(context, connection, reply);
+                free_bvalue(reply);
+            }
+        }
+    }
+    free(pfds);
+}
+
+#endif
+
+/* -- bench --------------------------------------------------------------- */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+/* Each --bench connection has at most one request in flight, identified by
+ * its id.
+ */
+
+enum bench_phase
+{
+    BENCH_CLONE,
+    BENCH_OP,
+    BENCH_CLOSE,
+    BENCH_PHASES
+};
+
+const char* const BENCH_PHASE_NAMES[BENCH_PHASES] = { "clone", "op", "close" };
+
+struct bench_client
+{
+    enum bench_phase phase;
+    _Bool opened;
+    long long started_us;
+    int serial;
+    char id[32];
+};
+
+struct bench
+{
+    struct options* options;
+    long issued;
+    long errors;
+    long long* samples[BENCH_PHASES];
+    long sample_count[BENCH_PHASES];
+};
+
+void bench_send(struct async_connection* connection, enum bench_phase phase)
+{
+    struct nrepl* nrepl = connection->nrepl;
+    struct bench_client* client = (struct bench_client*)connection->data;
+    char* message = NULL;
+    size_t length = 0;
+    sprintf(client->id, "%d", ++client->serial);
+    client->phase = phase;
+    switch (phase)
+    {
+    case BENCH_CLONE:
+        message = format_message(&length, "d2:op5:clone2:id%lu:%se",
+            strlen(client->id), client->id);
+        break;
+    case BENCH_OP:
+        message = options_op_message(nrepl->options, nrepl->session, nrepl->options->code,
+            client->id, &length);
+        break;
+    case BENCH_CLOSE:
+        message = format_message(&length, "d2:op5:close7:session%lu:%s2:id%lu:%se",
+            strlen(nrepl->session), nrepl->session,
+            strlen(client->id), client->id);
+        break;
+    default:
+        break;
+    }
+    client->started_us = now_us();
+    async_send(connection, message, length);
+}
+
+/* Sends the next request after CONNECTION's previous one is done. */
+void bench_next(struct bench* bench, struct async_connection* connection)
+{
+    struct bench_client* client = (struct bench_client*)connection->data;
+    _Bool reuse = bench->options->bench_reuse_sessions;
+    long requests = bench->options->bench_requests;
+    if (!connection->nrepl->session)
+    {
+        if (bench->issued >= requests || (reuse && client->opened))
+        {
+            connection->finished = true;
+            return;
+        }
+        if (!reuse)
+            bench->issued++;
+        client->opened = true;
+        bench_send(connection, BENCH_CLONE);
+    }
+    else if (BENCH_CLONE == client->phase || (reuse && BENCH_OP == client->phase))
+    {
+        if (reuse && bench->issued >= requests)
+            bench_send(connection, BENCH_CLOSE);
+        else
+        {
+            if (reuse)
+                bench->issued++;
+            bench_send(connection, BENCH_OP);
+        }
+    }
+    else
+        bench_send(connection, BENCH_CLOSE);
+}
+
+void bench_receive(void* context, struct async_connection* connection, struct bvalue* reply)
+{
+    struct bench* bench = (struct bench*)context;
+    struct bench_client* client = (struct bench_client*)connection->data;
+    struct nrepl* nrepl = connection->nrepl;
+    if (bench->options->verbose)
+        nrepl_verbose_reply(connection->output, reply);
+    if (!bvalue_equals_string(bvalue_dictionary_get(reply, "id"), client->id))
+        return;
+
+    struct bvalue* new_session = bvalue_dictionary_get(reply, "new-session");
+    if (new_session && BVALUE_BYTESTRING == new_session->type)
+        nrepl->session = strdup(new_session->value.bsvalue.data);
+    if (bvalue_dictionary_get(reply, "ex") || bvalue_has_status(reply, "error"))
+        bench->errors++;
+    if (!bvalue_has_status(reply, "done"))
+        return;
+
+    bench->samples[client->phase][bench->sample_count[client->phase]++] = now_us() - client->started_us;
+    if (BENCH_CLOSE == client->phase)
+    {
+        free(nrepl->session);
+        nrepl->session = NULL;
+    }
+    bench_next(bench, connection);
+}
+
+int bench_compare_samples(const void* a, const void* b)
+{
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_report(struct bench* bench, const char* backend, long long elapsed_us)
+{
+    printf("requests: %ld  concurrency: %d  sessions: %s  io: %s  errors: %ld\n",
+        bench->options->bench_requests, bench->options->bench_concurrency,
+        bench->options->bench_reuse_sessions ? "reuse" : "clone", backend, bench->errors);
+    printf("elapsed: %.3fs  throughput: %.1f requests/s\n",
+        elapsed_us / 1e6, bench->options->bench_requests / (elapsed_us / 1e6));
+    printf("%-6s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean", "p50", "p90", "p99", "max");
+    for (int phase = 0; phase < BENCH_PHASES; phase++)
+    {
+        long count = bench->sample_count[phase];
+        long long* samples = bench->samples[phase];
+        if (0 == count)
+            continue;
+        qsort(samples, count, sizeof(long long), bench_compare_samples);
+        long long total = 0;
+        for (long i = 0; i < count; i++)
+            total += samples[i];
+        printf("%-6s %8ld %8.3fms %8.3fms %8.3fms %8.3fms %8.3fms\n",
+            BENCH_PHASE_NAMES[phase], count,
+            total / 1e3 / count,
+            samples[(count - 1) * 50 / 100] / 1e3,
+            samples[(count - 1) * 90 / 100] / 1e3,
+            samples[(count - 1) * 99 / 100] / 1e3,
+            samples[count - 1] / 1e3);
+    }
+}
+
+int bench_run(struct options* options)
+{
+    struct bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.options = options;
+    for (int phase = 0; phase < BENCH_PHASES; phase++)
+        bench.samples[phase] = (long long*)malloc((options->bench_requests + options->bench_concurrency) * sizeof(long long));
+
+    int count = options->bench_concurrency;
+    struct async_connection* connections = (struct async_connection*)calloc(count, sizeof(struct async_connection));
+    struct bench_client* clients = (struct bench_client*)calloc(count, sizeof(struct bench_client));
+    for (int i = 0; i < count; i++)
+    {
+        async_open(&connections[i], options, i ? connections[0].nrepl : NULL);
+        connections[i].data = &clients[i];
+    }
+
+    const char* backend = async_backend();
+    long long started_us = now_us();
+    for (int i = 0; i < count; i++)
+        bench_next(&bench, &connections[i]);
+    async_run(connections, count, bench_receive, &bench);
+    bench_report(&bench, backend, now_us() - started_us);
+
+    for (int i = 0; i < count; i++)
+        async_close(&connections[i]);
+    free(connections);
+    free(clients);
+    for (int phase = 0; phase < BENCH_PHASES; phase++)
+        free(bench.samples[phase]);
+    return bench.errors ? 1 : 0;
+}
+
+#endif
+
+/* -- jobs ---------------------------------------------------------------- */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+/* --jobs splits CODE into its top-level forms and evaluates them on several
+ * cloned sessions at once.  A session takes the next form as soon as it is
+ * done with its last one.  Each form's output is kept until every form
+ * before it is done, so that it prints in input order, or else printed as it
+ * arrives with each line labeled by the form's position.  Labeled lines
+ * from every job share the same fds, so each line is written whole, and an
+ * unfinished line is kept until its newline arrives or its job is done.
+ */
+
+struct job_output
+{
+    int fd;
+    struct bvalue* text;
+};
+
+struct job
+{
+    char* code;
+    _Bool done;
+    struct job_output* output;
+    int output_count;
+};
+
+enum job_session_state
+{
+    JOB_CLONING,
+    JOB_INITIALIZING,
+    JOB_EVALUATING,
+    JOB_CLOSING,
+    JOB_CLOSED
+};
+
+struct job_session
+{
+    struct jobs* jobs;
+    struct async_connection* connection;
+    enum job_session_state state;
+    char* session;
+    char id[32];
+    int serial;
+    int job;
+    _Bool value_open;
+};
+
+struct jobs
+{
+    struct options* options;
+    struct nrepl* output;
+    struct job* jobs;
+    int count;
+    int started;
+    int printed;
+    struct job_session* sessions;
+    int session_count;
+    _Bool stopped;
+    _Bool exception_occurred;
+};
+
+/* Returns JOB's output kept for FD, starting some if there is none.  Kept
+ * output is in order of arrival, and with labels, there is one per fd.
+ */
+struct bvalue** job_kept_output(struct job* job, int fd, _Bool labeled)
+{
+    if (labeled)
+        for (int i = 0; i < job->output_count; i++)
+            if (job->output[i].fd == fd)
+                return &job->output[i].text;
+    if (0 == job->output_count || job->output[job->output_count - 1].fd != fd)
+    {
+        job->output = (struct job_output*)realloc(job->output, (job->output_count + 1) * sizeof(struct job_output));
+        job->output[job->output_count].fd = fd;
+        job->output[job->output_count].text = allocate_bvalue_bytestring(256);
+        job->output_count++;
+    }
+    return &job->output[job->output_count - 1].text;
+}
+
+/* Writes the label of job INDEX, then PARTIAL and DATA, as one line. */
+void job_write_line(struct jobs* jobs, int index, int fd, struct bvalue* partial, const char* data, size_t size)
+{
+    char label[32];
+    sprintf(label, "[%d] ", index + 1);
+    struct bvalue* line = allocate_bvalue_bytestring(strlen(label) + partial->value.bsvalue.size + size + 1);
+    bvalue_append_string(&line, label, strlen(label));
+    bvalue_append_string(&line, partial->value.bsvalue.data, partial->value.bsvalue.size);
+    bvalue_append_string(&line, data, size);
+    nrepl_output(jobs->output, fd, line->value.bsvalue.data, line->value.bsvalue.size);
+    free_bvalue(line);
+    partial->value.bsvalue.size = 0;
+    partial->value.bsvalue.data[0] = '\0';
+}
+
+void job_write(void* context, int fd, const char* data, size_t size)
+{
+    struct job_session* session = (struct job_session*)context;
+    struct jobs* jobs = session->jobs;
+    struct job* job = &jobs->jobs[session->job];
+    if (0 == size)
+        return;
+
+    _Bool labeled = jobs->options->jobs_labeled;
+    struct bvalue** kept = job_kept_output(job, fd, labeled);
+    while (labeled && size > 0)
+    {
+        const char* newline = (const char*)memchr(data, '\n', size);
+        if (!newline)
+            break;
+        size_t length = (size_t)(newline - data) + 1;
+        job_write_line(jobs, session->job, fd, *kept, data, length);
+        data += length;
+        size -= length;
+    }
+    bvalue_append_string(kept, data, size);
+}
+
+/* Prints and frees the output kept for job INDEX.  With labels, that is the
+ * unfinished last line written to each fd, which is ended here.
+ */
+void job_print_output(struct jobs* jobs, int index)
+{
+    struct job* job = &jobs->jobs[index];
+    for (int i = 0; i < job->output_count; i++)
+    {
+        struct bvalue* text = job->output[i].text;
+        if (!jobs->options->jobs_labeled)
+            nrepl_output(jobs->output, job->output[i].fd, text->value.bsvalue.data, text->value.bsvalue.size);
+        else if (text->value.bsvalue.size > 0)
+            job_write_line(jobs, index, job->output[i].fd, text, "\n", 1);
+        free_bvalue(text);
+    }
+    free(job->output);
+    job->output = NULL;
+    job->output_count = 0;
+}
+
+/* Prints the output of finished jobs which have no unfinished job before
+ * them, or of every finished job if ALL.
+ */
+void jobs_print_finished(struct jobs* jobs, _Bool all)
+{
+    for (; jobs->printed < jobs->count && (all || jobs->jobs[jobs->printed].done); jobs->printed++)
+        job_print_output(jobs, jobs->printed);
+}
+
+void job_session_send(struct job_session* session, enum job_session_state state, char* message, size_t length)
+{
+    session->state = state;
+    async_send(session->connection, message, length);
+}
+
+const char* job_session_next_id(struct job_session* session)
+{
+    sprintf(session->id, "%d.%d", (int)(session - session->jobs->sessions), ++session->serial);
+    return session->id;
+}
+
+/* Starts the next job on SESSION, or closes SESSION if there are none left. */
+void job_session_next(struct job_session* session)
+{
+    struct jobs* jobs = session->jobs;
+    size_t length;
+    if (jobs->stopped || jobs->started >= jobs->count)
+    {
+        const char* id = job_session_next_id(session);
+        char* message = format_message(&length, "d2:op5:close7:session%lu:%s2:id%lu:%se",
+            strlen(session->session), session->session,
+            strlen(id), id);
+        job_session_send(session, JOB_CLOSING, message, length);
+        return;
+    }
+    session->job = jobs->started++;
+    char* message = options_op_message(jobs->options, session->session, jobs->jobs[session->job].code,
+        job_session_next_id(session), &length);
+    job_session_send(session, JOB_EVALUATING, message, length);
+}
+
+void job_session_closed(struct job_session* session)
+{
+    struct jobs* jobs = session->jobs;
+    session->state = JOB_CLOSED;
+    for (int i = 0; i < jobs->session_count; i++)
+        if (jobs->sessions[i].connection == session->connection && JOB_CLOSED != jobs->sessions[i].state)
+            return;
+    session->connection->finished = true;
+}
+
+void jobs_receive(void* context, struct async_connection* connection, struct bvalue* reply)
+{
+    struct jobs* jobs = (struct jobs*)context;
+    if (jobs->options->verbose)
+        nrepl_verbose_reply(jobs->output, reply);
+
+    struct bvalue* id = bvalue_dictionary_get(reply, "id");
+    if (NULL == id || BVALUE_BYTESTRING != id->type)
+        return;
+    int index = atoi(id->value.bsvalue.data);
+    if (index < 0 || index >= jobs->session_count)
+        return;
+    struct job_session* session = &jobs->sessions[index];
+    if (session->connection != connection || !bvalue_equals_string(id, session->id))
+        return;
+
+    _Bool done = bvalue_has_status(reply, "done");
+    switch (session->state)
+    {
+    case JOB_CLONING:
+    {
+        struct bvalue* new_session = bvalue_dictionary_get(reply, "new-session");
+        if (new_session && BVALUE_BYTESTRING == new_session->type)
+            session->session = strdup(new_session->value.bsvalue.data);
+        if (!done)
+            break;
+        if (NULL == session->session)
+        {
+            jobs->stopped = true;
+            job_session_closed(session);
+        }
+        else if (jobs->options->session_init)
+        {
+            size_t length;
+            const char* id = job_session_next_id(session);
+            char* message = format_message(&length, "d2:op4:eval7:session%lu:%s4:code%lu:%s2:id%lu:%se",
+                strlen(session->session), session->session,
+                strlen(jobs->options->session_init), jobs->options->session_init,
+                strlen(id), id);
+            job_session_send(session, JOB_INITIALIZING, message, length);
+        }
+        else
+            job_session_next(session);
+        break;
+    }
+    case JOB_INITIALIZING:
+    {
+        struct bvalue* err = bvalue_dictionary_get(reply, "err");
+        if (err && BVALUE_BYTESTRING == err->type)
+            nrepl_output(jobs->output, 2, err->value.bsvalue.data, err->value.bsvalue.size);
+        if (bvalue_dictionary_get(reply, "ex") || bvalue_has_status(reply, "error"))
+            jobs->stopped = true;
+        if (done)
+            job_session_next(session);
+        break;
+    }
+    case JOB_EVALUATING:
+        if (nrepl_handle_reply(connection->nrepl, reply, job_write, session, &jobs->exception_occurred, &session->value_open))
+        {
+            jobs->jobs[session->job].done = true;
+            if (jobs->options->jobs_labeled)
+                job_print_output(jobs, session->job);
+            jobs_print_finished(jobs, false);
+            job_session_next(session);
+        }
+        break;
+    case JOB_CLOSING:
+        if (done)
+            job_session_closed(session);
+        break;
+    default:
+        break;
+    }
+}
+
+int jobs_run(struct options* options)
+{
+    struct jobs jobs;
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.options = options;
+
+    char** texts = NULL;
+    size_t size = 0;
+    char* code = options->code[0] ? strdup(options->code) : slurp_stream(stdin, &size);
+    jobs.count = form_split(code, strlen(code), &texts);
+    free(code);
+    jobs.jobs = (struct job*)calloc(jobs.count + 1, sizeof(struct job));
+    for (int i = 0; i < jobs.count; i++)
+        jobs.jobs[i].code = texts[i];
+    free(texts);
+
+    int connection_count = options->jobs_connections < options->jobs ? options->jobs_connections : options->jobs;
+    struct async_connection* connections = (struct async_connection*)calloc(connection_count, sizeof(struct async_connection));
+    for (int i = 0; i < connection_count; i++)
+        async_open(&connections[i], options, i ? connections[0].nrepl : NULL);
+    jobs.output = connections[0].nrepl;
+
+    jobs.session_count = options->jobs;
+    jobs.sessions = (struct job_session*)calloc(jobs.session_count, sizeof(struct job_session));
+    for (int i = 0; i < jobs.session_count; i++)
+    {
+        struct job_session* session = &jobs.sessions[i];
+        session->jobs = &jobs;
+        session->connection = &connections[i % connection_count];
+        session->job = -1;
+        size_t length;
+        const char* id = job_session_next_id(session);
+        char* message = format_message(&length, "d2:op5:clone2:id%lu:%se", strlen(id), id);
+        job_session_send(session, JOB_CLONING, message, length);
+    }
+
+    async_run(connections, connection_count, jobs_receive, &jobs);
+    jobs_print_finished(&jobs, true);
+
+    for (int i = 0; i < jobs.session_count; i++)
+        if (jobs.sessions[i].session)
+            free(jobs.sessions[i].session);
+    free(jobs.sessions);
+    for (int i = 0; i < connection_count; i++)
+        async_close(&connections[i]);
+    free(connections);
+    for (int i = 0; i < jobs.count; i++)
+        free(jobs.jobs[i].code);
+    free(jobs.jobs);
+    return jobs.stopped || jobs.exception_occurred ? 1 : 0;
+}
+
+#endif
+
+/* -- watch --------------------------------------------------------------- */
+
+#if defined(__linux__)
+
+struct watch
+{
+    int fd;
+    int count;
+    int* descriptors;
+    char** directories;
+    int changed_count;
+    char** changed;
+};
+
+volatile sig_atomic_t watch_interrupted = 0;
+
+void watch_handle_interrupt(int signal)
+{
+    (void)signal;
+    watch_interrupted = 1;
+}
+
+/* Watches DIRECTORY and the directories under it.  Symbolic links below
+ * DIRECTORY are not followed, and a directory which is already watched,
+ * e.g. through a bind mount, is not descended into again.
+ */
+void watch_add_tree(struct watch* watch, const char* directory)
+{
+    int wd = inotify_add_watch(watch->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (-1 == wd)
+        return;
+    for (int i = 0; i < watch->count; i++)
+        if (watch->descriptors[i] == wd)
+            return;
+    watch->descriptors = (int*)realloc(watch->descriptors, (watch->count + 1) * sizeof(int));
+    watch->directories = (char**)realloc(watch->directories, (watch->count + 1) * sizeof(char*));
+    watch->descriptors[watch->count] = wd;
+    watch->directories[watch->count] = strdup(directory);
+    watch->count++;
+
+    DIR* dir = opendir(directory);
+    if (NULL == dir)
+        return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if ('.' == entry->d_name[0])
+            continue;
+        char* path = (char*)malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", directory, entry->d_name);
+        struct stat statb;
+        if (0 == lstat(path, &statb) && S_ISDIR(statb.st_mode))
+            watch_add_tree(watch, path);
+        free(path);
+    }
+    closedir(dir);
+}
+
+struct watch* make_watch(const char* directory)
+{
+    struct watch* watch = (struct watch*)malloc(sizeof(struct watch));
+    memset(watch, 0, sizeof(struct watch));
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (-1 == watch->fd)
+        error("inotify_init1");
+    char* absolute_directory = make_path_absolute(directory);
+    watch_add_tree(watch, absolute_directory);
+    free(absolute_directory);
+    if (0 == watch->count)
+        error(directory);
+    return watch;
+}
+
+void watch_clear_changes(struct watch* watch)
+{
+    for (int i = 0; i < watch->changed_count; i++)
+        free(watch->changed[i]);
+    watch->changed_count = 0;
+}
+
+void free_watch(struct watch* watch)
+{
+    watch_clear_changes(watch);
+    for (int i = 0; i < watch->count; i++)
+        free(watch->directories[i]);
+    free(watch->directories);
+    free(watch->descriptors);
+    free(watch->changed);
+    close(watch->fd);
+    free(watch);
+}
+
+/* Editor backup, swap, and lock files are not interesting. */
+_Bool watch_ignored(const char* name)
+{
+    size_t length = strlen(name);
+    return '.' == name[0] || '#' == name[0] || 0 == length || '~' == name[length - 1];
+}
+
+void watch_note_change(struct watch* watch, const char* path)
+{
+    for (int i = 0; i < watch->changed_count; i++)
+        if (!strcmp(watch->changed[i], path))
+            return;
+    watch->changed = (char**)realloc(watch->changed, (watch->changed_count + 1) * sizeof(char*));
+    watch->changed[watch->changed_count++] = strdup(path);
+}
+
+void watch_read_events(struct watch* watch)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+    if (length < 0)
     {
-        options->line = atoi(line);
-        options->column = atoi(strchr(line, ':') + 1);
+        if (EINTR == errno)
+            return;
+        error("read");
     }
-    else if (1 == colons)
+    for (char* p = buffer; p < buffer + length; )
     {
-        options->filename = strdup_up_to(line, ':');
-        options->line = atoi(strchr(line, ':') + 1);
+        struct inotify_event* event = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (0 == event->len || watch_ignored(event->name))
+            continue;
+        const char* directory = NULL;
+        for (int i = 0; i < watch->count; i++)
+            if (watch->descriptors[i] == event->wd)
+                directory = watch->directories[i];
+        if (NULL == directory)
+            continue;
+        char* path = (char*)malloc(strlen(directory) + strlen(event->name) + 2);
+        sprintf(path, "%s/%s", directory, event->name);
+        if (event->mask & IN_ISDIR)
+            watch_add_tree(watch, path);
+        else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            watch_note_change(watch, path);
+        free(path);
     }
-    else if (0 == colons && 0 == nondigits)
-        options->line = atoi(line);
-    else if (0 == colons)
+}
+
+/* Blocks until files have changed and no more changes have been seen for
+ * DEBOUNCE_MS.  Returns false if interrupted.
+ */
+_Bool watch_wait_for_changes(struct watch* watch, long debounce_ms)
+{
+    watch_clear_changes(watch);
+    while (!watch_interrupted)
     {
-        options->filename = strdup(line);
-        options->line = 1;
+        struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, watch->changed_count ? (int)debounce_ms : -1);
+        if (ready < 0 && EINTR != errno)
+            error("poll");
+        if (ready > 0)
+            watch_read_events(watch);
+        else if (0 == ready)
+            return true;
     }
-    else
-        options_fail("invalid value for --line");
+    return false;
 }
 
-void options_parse_send(struct options* options, const char* send)
+/* Keeps one session open and evaluates CODE, or loads the changed files if
+ * there is no CODE, every time something changes under the watched
+ * directory.  Runs until interrupted.
+ */
+int nrepl_watch(struct nrepl* nrepl)
 {
-    char* key = NULL;
-    char* type = NULL;
+    struct watch* watch = make_watch(nrepl->options->watch);
 
-    if (NULL == strchr(send, ','))
-        options_fail("--send value must be KEY,TYPE,VALUE");
-    key = strdup_up_to(send, ',');
-    send = strchr(send, ',') + 1;
-
-    if (NULL == strchr(send, ','))
-        options_fail("--send value must be KEY,TYPE,VALUE");
-    type = strdup_up_to(send, ',');
-    send = strchr(send, ',') + 1;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watch_handle_interrupt;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
 
-    options->send = (char*)realloc(options->send, strlen(options->send) + strlen(key) + 16 + strlen(send) + 16);
-    sprintf(options->send + strlen(options->send), "%lu:%s", strlen(key), key);
-    if (!strcmp(type, "string"))
-        sprintf(options->send + strlen(options->send), "%lu:%s", strlen(send), send);
-    else if (!strcmp(type, "integer"))
-        sprintf(options->send + strlen(options->send), "i%de", atoi(send));
-    else
-        options_fail("--send TYPE must be 'string' or 'integer'");
-}
+    nrepl->exception_occurred = false;
+    if (nrepl_open_session(nrepl))
+    {
+        free_watch(watch);
+        return 1;
+    }
 
-struct options* parse_options(int argc, char* argv[])
-{
-    struct options* options = new_options();
-    int opt;
-    _Bool have_print = false;
-    while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, NULL)) != -1)
+    while (watch_wait_for_changes(watch, nrepl->options->debounce_ms))
     {
-        switch (opt)
+        if (*nrepl->options->code)
+            nrepl_send_op(nrepl, nrepl->options->code);
+        else
         {
-        case 'h':
-            options->help = true;
-            break;
-        case 'l':
-            options_parse_line(options, optarg);
-            break;
-        case 'n':
-            free(options->namespace);
-            options->namespace = strdup(optarg);
-            break;
-        case 'p':
-            free(options->port);
-            options->port = strdup(optarg);
-            break;
-        case 'S':
-            if (options->session_init)
-                free(options->session_init);
-            options->session_init = strdup(optarg);
-            break;
-        case 'v':
-            options->verbose = true;
-            break;
-        case OPT_OP:
-            free(options->op);
-            options->op = strdup(optarg);
-            break;
-        case OPT_NO_PRINT:
-            remove_print_option(&options->print, optarg);
-            break;
-        case OPT_PRINT:
-            if (!have_print)
-            {
-                free_print_options(options->print);
-                options->print = NULL;
-                have_print = true;
-            }
-            append_print_option(&options->print, make_print_option(optarg));
-            break;
-        case OPT_SEND:
-            options_parse_send(options, optarg);
-            break;
-        case '?':
-            exit(2);
+            for (int i = 0; i < watch->changed_count && !watch_interrupted; i++)
+                if (is_clojure_source(watch->changed[i]))
+                    nrepl_load_file(nrepl, watch->changed[i]);
         }
     }
-    options->code = collect_code(argc, argv, optind);
-    return options;
+
+    nrepl_close_session(nrepl);
+    free_watch(watch);
+    return 0;
 }
 
-void free_options(struct options* options)
+#endif
+
+/* -- tail --------------------------------------------------------------- */
+
+/* --tail subscribes to the server's *out* and *err* with cider-nrepl's
+ * out-subscribe and prints them until interrupted.  Replies are decoded as
+ * they arrive and their output is gathered in a fixed buffer, which is
+ * written when no complete reply is left to decode, so a busy server costs
+ * one write per receive rather than one per line.  If the server goes away,
+ * rep reconnects, waiting for it as with --wait, and subscribes again.
+ */
+
+#if !defined(_WIN32) && !defined(WIN32)
+
+#define TAIL_BUFFER_SIZE 65536
+
+volatile sig_atomic_t tail_interrupted = 0;
+
+/* The handler also writes to a pipe which is polled along with the socket,
+ * so that a signal arriving just before poll() still wakes it.
+ */
+int tail_wakeup[2] = { -1, -1 };
+
+void tail_handle_interrupt(int signal)
 {
-    if (options->port)
-        free(options->port);
-    if (options->op)
-        free(options->op);
-    if (options->namespace)
-        free(options->namespace);
-    if (options->code)
-        free(options->code);
-    if (options->filename)
-        free(options->filename);
-    if (options->send)
-        free(options->send);
-    free_print_options(options->print);
-    if (options->session_init)
-        free(options->session_init);
-    free(options);
+    (void)signal;
+    int saved_errno = errno;
+    tail_interrupted = 1;
+    if (-1 != tail_wakeup[1])
+        (void)write(tail_wakeup[1], "", 1);
+    errno = saved_errno;
 }
 
-/* -- nrepl --------------------------------------------------------------- */
+/* Until a session is open there is nothing to clean up, so a signal while
+ * waiting for the server just ends rep.
+ */
+void tail_catch_signals(_Bool catch)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = catch ? tail_handle_interrupt : SIG_DFL;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
 
-struct nrepl
+struct tail_output
 {
-    struct options* options;
+    struct nrepl* nrepl;
     int fd;
-    struct breader *decode;
-    _Bool exception_occurred;
-    char* session;
+    size_t size;
+    char data[TAIL_BUFFER_SIZE];
 };
 
-struct nrepl* make_nrepl(struct options* options)
+void tail_flush(struct tail_output* output)
 {
-    struct nrepl* nrepl = (struct nrepl*)malloc(sizeof(struct nrepl));
-    nrepl->options = options;
+    if (output->size > 0)
+        nrepl_output(output->nrepl, output->fd, output->data, output->size);
+    output->size = 0;
+}
+
+void tail_write(void* context, int fd, const char* data, size_t size)
+{
+    struct tail_output* output = (struct tail_output*)context;
+    if (fd != output->fd || output->size + size > TAIL_BUFFER_SIZE)
+        tail_flush(output);
+    output->fd = fd;
+    if (size > TAIL_BUFFER_SIZE)
+    {
+        nrepl_output(output->nrepl, fd, data, size);
+        return;
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+}
+
+/* Replaces a lost connection with a fresh, unconnected socket, which keeps
+ * recording to the same --record file.
+ */
+void nrepl_reset(struct nrepl* nrepl)
+{
+    close(nrepl->fd);
     nrepl->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (nrepl->fd == -1)
         error("socket");
+    struct recording* recording = nrepl->decode->recording;
+    free_breader(nrepl->decode);
     nrepl->decode = make_breader(nrepl->fd);
-    nrepl->exception_occurred = false;
+    nrepl->decode->recording = recording;
+    if (nrepl->session)
+        free(nrepl->session);
     nrepl->session = NULL;
-    return nrepl;
+    nrepl->value_open = false;
 }
 
-void free_nrepl(struct nrepl* nrepl)
+/* Sends MESSAGE without dying if the server has gone away. */
+_Bool tail_send(struct nrepl* nrepl, const char* format, ...)
 {
-    free_options(nrepl->options);
-    if (nrepl->fd >= 0)
-        close(nrepl->fd);
-    if (nrepl->decode)
-        free_breader(nrepl->decode);
-    if (nrepl->session)
-        free(nrepl->session);
-    free(nrepl);
+    va_list vargs;
+    size_t length;
+    va_start(vargs, format);
+    char* message = vformat_message(&length, format, vargs);
+    va_end(vargs);
+
+    if (nrepl->options->verbose)
+        nrepl_verbose_message(nrepl, message, length);
+    _Bool sent = send(nrepl->fd, message, length, MSG_NOSIGNAL) == (ssize_t)length;
+    if (sent)
+        recording_write(nrepl->decode->recording, '>', nrepl->decode->connection, message, length);
+    free(message);
+    return sent;
 }
 
-void nrepl_receive_until_done(struct nrepl* nrepl)
+enum tail_result
 {
-    _Bool done = false;
-    while (!done)
-    {
-        struct bvalue* reply = breader_read(nrepl->decode);
+    TAIL_INTERRUPTED,
+    TAIL_LOST,
+    TAIL_UNSUPPORTED
+};
 
-        if (nrepl->options->verbose)
-        {
-            printf("<< ");
-            bvalue_dump(reply, "<< ");
-            printf("\n");
-        }
+/* Clones a session on a fresh connection, subscribes, and prints output
+ * until interrupted or until the connection is lost.  Everything after
+ * connect() tolerates the server going away, since it may be restarting.
+ * *SUBSCRIBED is set once the subscription is acknowledged.  A reconnect
+ * waits for the server, whether or not --wait was given.
+ */
+enum tail_result nrepl_tail_session(struct nrepl* nrepl, struct tail_output* output, _Bool reconnecting, _Bool* subscribed)
+{
+    static const char SUBSCRIBE_ID[] = "rep-tail";
+    _Bool exception_occurred = false;
+    _Bool subscribing = false;
+    *subscribed = false;
 
-        struct bvalue* new_session = bvalue_dictionary_get(reply, "new-session");
-        if (new_session && BVALUE_BYTESTRING == new_session->type)
+    tail_catch_signals(false);
+    nrepl_connect_waiting(nrepl, reconnecting || nrepl->options->wait);
+    tail_catch_signals(true);
+    if (!tail_send(nrepl, "d2:op5:clonee"))
+        return TAIL_LOST;
+    while (!tail_interrupted)
+    {
+        while (breader_has_value(nrepl->decode))
         {
-            if (nrepl->session)
-                free(nrepl->session);
-            nrepl->session = strdup(new_session->value.bsvalue.data);
+            struct bvalue* reply = nrepl_receive(nrepl);
+            struct bvalue* id = bvalue_dictionary_get(reply, "id");
+            _Bool acknowledged = subscribing && !*subscribed && id && BVALUE_BYTESTRING == id->type &&
+                !strcmp(id->value.bsvalue.data, SUBSCRIBE_ID) && bvalue_has_status(reply, "done");
+            nrepl_handle_reply(nrepl, reply, tail_write, output, &exception_occurred, &nrepl->value_open);
+            free_bvalue(reply);
+            if (acknowledged && exception_occurred)
+                return TAIL_UNSUPPORTED;
+            if (acknowledged)
+                *subscribed = true;
         }
+        tail_flush(output);
 
-        for (struct print_option* print = nrepl->options->print; print; print = print->next)
+        if (nrepl->session && !subscribing)
         {
-            if (NULL == bvalue_dictionary_get(reply, print->key))
-                continue;
-            struct bvalue* s = bvalue_format(reply, print->format);
-            (void)write(print->fd, s->value.bsvalue.data, s->value.bsvalue.size);
-            free_bvalue(s);
+            if (!tail_send(nrepl, "d2:op13:out-subscribe7:session%lu:%s2:id%lu:%se",
+                    strlen(nrepl->session), nrepl->session,
+                    strlen(SUBSCRIBE_ID), SUBSCRIBE_ID))
+                return TAIL_LOST;
+            subscribing = true;
         }
 
-        struct bvalue* ex = bvalue_dictionary_get(reply, "ex");
-        if (ex)
-            nrepl->exception_occurred = true;
-
-        if (bvalue_has_status(reply, "done"))
-            done = true;
-        if (bvalue_has_status(reply, "error"))
-            nrepl->exception_occurred = true;
-        if (bvalue_has_status(reply, "namespace-not-found"))
+        struct pollfd pfds[2] =
         {
-            static const char MESSAGE[] = "the namespace does not exist\n";
-            (void)write(2, MESSAGE, strlen(MESSAGE));
-        }
-
-        free_bvalue(reply);
+            { .fd = nrepl->fd, .events = POLLIN },
+            { .fd = tail_wakeup[0], .events = POLLIN }
+        };
+        int ready = poll(pfds, 2, -1);
+        if (ready < 0 && EINTR != errno)
+            error("poll");
+        if (ready > 0 && pfds[0].revents && breader_fill(nrepl->decode) <= 0)
+            return TAIL_LOST;
     }
+    return TAIL_INTERRUPTED;
 }
 
-void nrepl_send(struct nrepl* nrepl, const char* format, ...)
+int nrepl_tail(struct nrepl* nrepl)
 {
-    va_list vargs;
-
-    va_start(vargs, format);
-    size_t length = vsnprintf(NULL, 0, format, vargs);
-    va_end(vargs);
-
-    char* message = (char*)malloc(length + 1);
-    va_start(vargs, format);
-    vsnprintf(message, length+1, format, vargs);
-    va_end(vargs);
-
-    if (nrepl->options->verbose)
+    struct tail_output* output = (struct tail_output*)malloc(sizeof(struct tail_output));
+    output->nrepl = nrepl;
+    output->fd = 1;
+    output->size = 0;
+    if (-1 == pipe(tail_wakeup))
+        error("pipe");
+    for (int i = 0; i < 2; i++)
     {
-        printf(">> ");
-        fwrite(message, 1, length, stdout);
-        printf("\n");
+        fcntl(tail_wakeup[i], F_SETFL, fcntl(tail_wakeup[i], F_GETFL) | O_NONBLOCK);
+        fcntl(tail_wakeup[i], F_SETFD, FD_CLOEXEC);
     }
 
-    if (send(nrepl->fd, message, length, 0) != length)
-        error("send");
-
-    free(message);
-
-    nrepl_receive_until_done(nrepl);
-}
-
-int nrepl_exec(struct nrepl* nrepl)
-{
-    nrepl->exception_occurred = false;
-
-    struct sockaddr_in address = options_address(nrepl->options, nrepl->options->port);
-    if (-1 == connect(nrepl->fd, (struct sockaddr*)&address, sizeof(address)))
-        error("connect");
-
-    nrepl_send(nrepl, "d2:op5:clonee");
-
-    if (nrepl->options->session_init)
+    int error_code = 0;
+    long backoff_ms = 100;
+    _Bool reconnecting = false;
+    for (;;)
     {
-        struct print_option *original_print = nrepl->options->print;
-        nrepl->options->print = make_print_option("err,2,%{err}");
-
-        nrepl_send(nrepl, "d2:op4:eval7:session%lu:%s4:code%lu:%se",
-            strlen(nrepl->session), nrepl->session,
-            strlen(nrepl->options->session_init), nrepl->options->session_init);
-
-        free_print_options(nrepl->options->print);
-        nrepl->options->print = original_print;
+        _Bool subscribed;
+        enum tail_result result = nrepl_tail_session(nrepl, output, reconnecting, &subscribed);
+        if (TAIL_INTERRUPTED == result)
+        {
+            if (subscribed)
+                nrepl_send(nrepl, "d2:op15:out-unsubscribe7:session%lu:%se",
+                    strlen(nrepl->session), nrepl->session);
+            if (nrepl->session)
+                nrepl_close_session(nrepl);
+            break;
+        }
+        if (TAIL_UNSUPPORTED == result)
+        {
+            fprintf(stderr, "rep: the server does not support out-subscribe\n");
+            nrepl_close_session(nrepl);
+            error_code = 1;
+            break;
+        }
 
-        if (nrepl->exception_occurred)
-            return 1;
+        /* Back off if the server keeps dropping us before we subscribe. */
+        if (subscribed)
+            backoff_ms = 100;
+        else
+        {
+            tail_catch_signals(false);
+            sleep_ms(backoff_ms);
+            if (backoff_ms < 5000)
+                backoff_ms *= 2;
+        }
+        if (tail_interrupted)
+            break;
+        fprintf(stderr, "rep: lost the connection to the server, reconnecting\n");
+        nrepl_reset(nrepl);
+        reconnecting = true;
     }
 
-    char extra_options[512] = "";
-    if (nrepl->options->line != -1)
-        sprintf(extra_options + strlen(extra_options), "4:linei%de", nrepl->options->line);
-    if (nrepl->options->column != -1)
-        sprintf(extra_options + strlen(extra_options), "6:columni%de", nrepl->options->column);
-    if (nrepl->options->filename)
-        sprintf(extra_options + strlen(extra_options), "4:file%lu:%s", strlen(nrepl->options->filename), nrepl->options->filename);
-
-    nrepl_send(nrepl, "d2:op%lu:%s2:ns%lu:%s7:session%lu:%s4:code%lu:%s%s%se",
-        strlen(nrepl->options->op), nrepl->options->op,
-        strlen(nrepl->options->namespace), nrepl->options->namespace,
-        strlen(nrepl->session), nrepl->session,
-        strlen(nrepl->options->code), nrepl->options->code,
-        nrepl->options->send,
-        extra_options);
-
-    nrepl_send(nrepl, "d2:op5:close7:session%lu:%se",
-        strlen(nrepl->session), nrepl->session);
-
-    if (nrepl->exception_occurred)
-        return 1;
-    return 0;
+    tail_catch_signals(false);
+    close(tail_wakeup[0]);
+    close(tail_wakeup[1]);
+    tail_wakeup[0] = tail_wakeup[1] = -1;
+    free(output);
+    return error_code;
 }
 
+#endif
+
 /* ------------------------------------------------------------------------ */
 
 void help(void)
@@ -1111,16 +6400,39 @@ rep: Single-shot nREPL client\n\
 Synopsis:\n\
   rep [OPTIONS] [--] [CODE ...]\n\
 Options:\n\
+  --bench=N[,CONCURRENCY]         Send the operation N times and report latencies.\n\
+  --bench-sessions=clone|reuse    Clone a session per request (default) or per connection.\n\
+  --debounce=MS                   With --watch, wait for MS quiet milliseconds (default: 100).\n\
   -h, --help                      Show this help screen.\n\
+  --io=poll|uring                 I/O backend for --bench and --jobs (default: poll).\n\
+  --jobs=N[,CONNECTIONS]          Evaluate each top-level form of CODE on N sessions.\n\
+  --jobs-output=ordered|labeled   Print each form's output in order (default) or labeled.\n\
   -l, --line=[FILE:]LINE[:COLUMN] Set reference file, line, and column for errors.\n\
-  -n, --namespace=NS              Evaluate code in NS (default: user).\n\
+  -n, --namespace=NS|@FILE        Evaluate code in NS, or FILE's namespace (default: user).\n\
   --no-print=KEY                  Suppress output for KEY.\n\
+  --on-exception=stacktrace|op:OP After an exception, print its stacktrace or send OP.\n\
   --op=OP                         nREPL operation (default: eval).\n\
+  --output-queue=SIZE[,POLICY]    Write output from a SIZE-byte queue on another thread.\n\
   -p, --port=ADDRESS              TCP port, host:port, @portfile, or @FNAME@RELATIVE.\n\
-  --print=KEY|KEY,FD,FORMAT       Print FORMAT to FD when KEY is present.\n\
+  --print=KEY|KEY,FD,FORMAT       Print FORMAT to FD, or to a file, when KEY is present.\n\
+  --print-buffer-size=SIZE        Have the server send streamed values in SIZE-byte chunks.\n\
+  --print-quota=SIZE              Have the server truncate values after SIZE bytes.\n\
+  --print-rotate=SIZE             Rotate --print files after SIZE bytes of output.\n\
+  --print-stream                  Have the server stream values, printing them as they arrive.\n\
+  --printer=VAR                   Have the server print values with VAR, e.g. clojure.pprint/pprint.\n\
+  --quote=none|kakoune|shell      Quote each value substituted into a --print format.\n\
+  --record=FILE                   Record all traffic with the server to FILE.\n\
+  --replay=FILE                   Replay the server's side of a recording instead of connecting.\n\
+  --replay-speed=original|max     Replay with the recorded timing (default) or at full speed.\n\
   --send=KEY,TYPE,VALUE           Send additional KEY of VALUE in request.\n\
   -S, --session-init=CODE         Evaluated first, e.g. '(cider.piggieback/cljs-repl :app)'.\n\
+  --sideload=PATH[:PATH...]       Serve the server's class and resource lookups from PATH.\n\
+  --supersede=KEY                 Interrupt an older evaluation with the same KEY first.\n\
+  --sync=DIR                      Load files under DIR which changed since the last sync.\n\
+  --tail                          Print the server's output until interrupted, reconnecting.\n\
   -v, --verbose                   Show all messages sent and received.\n\
+  --wait[=TIMEOUT]                Wait up to TIMEOUT seconds for the server to start.\n\
+  --watch=DIR                     Evaluate CODE, or load changed files, when DIR changes.\n\
 \n");
 }
 
@@ -1140,8 +6452,36 @@ int main(int argc, char *argv[])
         help();
         exit(0);
     }
-    struct nrepl* nrepl = make_nrepl(options);
-    int error_code = nrepl_exec(nrepl);
-    free_nrepl(nrepl);
+    options_resolve_namespace(options);
+    int error_code;
+#if !defined(_WIN32) && !defined(WIN32)
+    /* --bench and --jobs open their own connections. */
+    if (options->bench_requests > 0 && !options->watch)
+        error_code = bench_run(options);
+    else if (options->jobs > 0 && !options->watch)
+        error_code = jobs_run(options);
+    else
+#endif
+    {
+        struct nrepl* nrepl = make_nrepl(options, true);
+#if defined(__linux__)
+        if (options->watch)
+            error_code = nrepl_watch(nrepl);
+        else
+#endif
+#if !defined(_WIN32) && !defined(WIN32)
+        if (options->tail)
+            error_code = nrepl_tail(nrepl);
+        else
+#endif
+        if (options->sync)
+            error_code = nrepl_sync(nrepl);
+        else
+            error_code = nrepl_exec(nrepl);
+        free_nrepl(nrepl);
+    }
+    free_options(options);
+    if (!close_print_targets() && 0 == error_code)
+        error_code = 255;
     exit(error_code);
 }
@@ -1,7 +1,15 @@
 (ns rep.core-test
   (:require
+    [clojure.java.io :as io]
     [midje.sweet :refer :all]
-    [rep.test-drivers :refer [rep prints exits-with]]))
+    [rep.test-drivers :refer [rep rep-tail reps-sharing-server with-one-server prints exits-with]])
+  (:import
+    (java.nio.file Files)
+    (java.nio.file.attribute FileAttribute)))
+
+(def ^:private stop-rep
+  "Code which stops the rep evaluating it, as ^C would."
+  "(doseq [p (iterator-seq (.iterator (.children (ProcessHandle/current))))] (.destroy p))")
 
 (facts "about basic evaluation of code"
   (rep "(+ 2 2)")                                  => (prints "4\n")
@@ -31,10 +39,21 @@
   (rep "-p" "@${user.dir}/target/.nrepl-port" "11")      => (prints "11\n")
   (rep "-p" "@.nrepl-port@/not-exist/foo/bar/baz" "91")  => (prints "rep: No ancestor of /not-exist/foo/bar/baz contains .nrepl-port\n" :to-stderr))
 
+(facts "about waiting for the nREPL server"
+  (rep "--wait" "42")                                       => (prints "42\n")
+  (rep "--wait=5" "-p" "@.nrepl-port@target/src/foo/bar.clj" "43") => (prints "43\n")
+  (rep "--wait=0.2" "-p" "@.does-not-exist" "42")           => (prints "rep: timed out waiting for nREPL server\n" :to-stderr)
+  (rep "--wait=0.2" "-p" "@.does-not-exist" "42")           => (exits-with 255)
+  (rep "--wait=soon" "42")                                  => (exits-with 2))
+
 (facts "about specifying the eval namespace"
   (facts "about sending a bare namespace name"
     (rep "-n" "user" "(str *ns*)")     => (prints "\"user\"\n")
-    (rep "-n" "rep.core-test" "(str *ns*)") => (prints "\"rep.core-test\"\n")))
+    (rep "-n" "rep.core-test" "(str *ns*)") => (prints "\"rep.core-test\"\n"))
+  (facts "about finding the namespace of a file"
+    (rep "-n" "@${user.dir}/test/rep/core_test.clj" "(str *ns*)")   => (prints "\"rep.core-test\"\n")
+    (rep "-n" "@${user.dir}/test/rep/test_drivers.clj" "(str *ns*)") => (prints "\"rep.test-drivers\"\n")
+    (rep "-n" "@does-not-exist.clj" "(str *ns*)")                   => (prints "\"user\"\n")))
 
 (facts "about specifying line numbers"
   (rep "(throw (Exception.))")                             => (prints #"\(:1\)" :to-stderr)
@@ -48,6 +67,13 @@
   (rep "-l" "foo.clj:18:11" "(do (def foo) (meta #'foo))") => (prints #":line 18")
   (rep "-l" "foo.clj:18:11" "(do (def foo) (meta #'foo))") => (prints #":column 15"))
 
+(facts "about print middleware options"
+  (rep "--print-stream" "(+ 1 1)")                                => (prints "2\n")
+  (rep "--print-stream" "--print=value,1,<%{value}>%n" "(+ 1 1)")  => (prints "<2>\n")
+  (rep "--print-quota=1k" "--print-buffer-size=64" "(+ 1 1)")      => (prints "2\n")
+  (rep "--printer=clojure.core/prn" "(+ 1 1)")                    => (exits-with 0)
+  (rep "--print-quota=lots" "(+ 1 1)")                            => (exits-with 2))
+
 (facts "about specifying the operation"
   (rep "--op=eval" "(+ 1 2)") => (prints "3\n")
   (rep "--op=rep-test-op") => (prints "\"hello\"\n"))
@@ -68,6 +94,199 @@
   (fact "it can suppress a key"
     (rep "--no-print=out" "(println 'whaat?)") => (prints "nil\n")))
 
+(facts "about --output-queue"
+  (rep "--output-queue=4k" "(println 'hello)")                => (prints "hello\nnil\n")
+  (rep "--output-queue=1k,block" "(apply str (repeat 5000 \\x))") => (prints (str \" (apply str (repeat 5000 \x)) \" \newline))
+  (rep "--output-queue=1k,spill" "(apply str (repeat 5000 \\x))") => (prints (str \" (apply str (repeat 5000 \x)) \" \newline))
+  (fact "a full block queue is drained through a slow consumer"
+    (rep "--output-queue=1k,block" "(dotimes [i 2000] (println (apply str (repeat 99 \\x))))" {:pipe-to "(sleep 1; wc -c)"})
+    => (prints #"^\s*200004\n$"))
+  (rep "--output-queue=12" "(+ 1 1)")                         => (exits-with 2))
+
+(facts "about --watch"
+  (rep "--watch=does-not-exist" "(+ 1 1)") => (prints #"does-not-exist: No such file or directory" :to-stderr)
+  (rep "--debounce=-5" "(+ 1 1)")          => (exits-with 2)
+  (fact "it evaluates CODE when a file changes, without following symbolic links"
+    (let [loop-link (.toPath (io/file "target/watched/loop"))]
+      (.mkdirs (io/file "target/watched"))
+      (Files/deleteIfExists loop-link)
+      (Files/createSymbolicLink loop-link (.toPath (io/file "..")) (make-array FileAttribute 0)))
+    (rep "--watch=watched"
+         "--session-init=(spit \"${user.dir}/target/watched/changed.clj\" \"\")"
+         (str "(do (println 'changed) " stop-rep ")")) => (prints "changed\nnil\n")))
+
+(facts "about --sync"
+  (rep "--sync=does-not-exist") => (prints #"does-not-exist: No such file or directory" :to-stderr)
+  (rep "--sync=does-not-exist") => (exits-with 255)
+  (let [dir (str (Files/createTempDirectory "rep-sync" (make-array FileAttribute 0)))
+        sync (str "--sync=" dir)
+        a (io/file dir "a.clj")
+        b (io/file dir "b.clj")
+        [first-run unchanged failed failed-again reverted]
+        (with-one-server
+          (fn [rep]
+            (spit a "(ns rep-sync.a (:require [rep-sync.b])) (println 'loaded-a)")
+            (spit b "(ns rep-sync.b) (println 'loaded-b)")
+            [(rep sync)
+             (rep sync)
+             (do
+               (spit a "(ns rep-sync.a (:require [rep-sync.b])) (throw (ex-info \"broken\" {}))")
+               (spit b "(ns rep-sync.b) (println 'loaded-b-again)")
+               (rep sync))
+             (rep sync)
+             (do
+               (spit a "(ns rep-sync.a (:require [rep-sync.b])) (println 'loaded-a)")
+               (rep sync))]))]
+    (fact "files are loaded after the files their ns forms require"
+      first-run => (prints "loaded-b\nnil\nloaded-a\nnil\n")
+      first-run => (exits-with 0))
+    (fact "unchanged files are not loaded again"
+      unchanged => (prints "")
+      unchanged => (exits-with 0))
+    (fact "a load which throws stops the sync and exits with 1"
+      failed => (prints "loaded-b-again\nnil\n")
+      failed => (prints #"broken" :to-stderr)
+      failed => (exits-with 1))
+    (fact "a file which failed is never recorded, but those loaded before it are"
+      failed-again => (prints "")
+      failed-again => (exits-with 1)
+      reverted     => (prints "loaded-a\nnil\n")
+      reverted     => (exits-with 0))))
+
+(facts "about --bench"
+  (rep "--bench=10,2" "(+ 1 1)")                          => (prints #"requests: 10  concurrency: 2  sessions: clone  io: poll  errors: 0")
+  (rep "--bench=10,2" "(+ 1 1)")                          => (exits-with 0)
+  (rep "--bench=4" "--bench-sessions=reuse" "(+ 1 1)")    => (prints #"(?m)^clone +1 ")
+  (rep "--bench=4" "--bench-sessions=reuse" "(+ 1 1)")    => (prints #"(?m)^op +4 ")
+  (rep "--bench=3" "(throw (Exception.))")                => (exits-with 1)
+  (rep "--bench=0" "(+ 1 1)")                             => (exits-with 2)
+  (rep "--bench=10,2" "--io=uring" "(+ 1 1)")             => (prints #"io: (uring|poll)  errors: 0")
+  (rep "--bench=10,2" "--io=select" "(+ 1 1)")            => (exits-with 2))
+
+(facts "about --jobs"
+  (rep "--jobs=2" "(+ 1 1) (+ 2 2) (+ 3 3)")                       => (prints "2\n4\n6\n")
+  (rep "--jobs=2,2" "(do (Thread/sleep 200) 1) 2")                 => (prints "1\n2\n")
+  (rep "--jobs=2" "--jobs-output=labeled" "(println :a) (+ 1 1)")  => (prints #"(?m)^\[1\] :a$")
+  (rep "--jobs=2" "--jobs-output=labeled" "(do (print 'a) (flush) (Thread/sleep 200) (println 'b)) (println 'c)") => (prints #"(?m)^\[1\] ab$")
+  (rep "--jobs=2" "(throw (Exception.)) (+ 1 1)")                  => (exits-with 1)
+  (rep "--jobs=2" "--io=uring" "(+ 1 1) (+ 2 2) (+ 3 3)")          => (prints "2\n4\n6\n")
+  (rep "--jobs=0" "(+ 1 1)")                                       => (exits-with 2)
+  (rep "--jobs=2" "--jobs-output=sorted" "(+ 1 1)")                => (exits-with 2))
+
+(facts "about --on-exception"
+  (rep "--on-exception=stacktrace" "(throw (Exception. \"boom\"))")   => (prints #"java.lang.Exception: boom" :to-stderr)
+  (rep "--on-exception=stacktrace" "(throw (Exception. \"boom\"))")   => (exits-with 1)
+  (rep "--on-exception=stacktrace" "(+ 1 1)")                        => (prints "2\n")
+  (rep "--on-exception=op:ls-sessions" "--print=sessions" "(throw (Exception.))") => (prints #"[a-fA-F0-9]{6}")
+  (rep "--on-exception=pst" "(+ 1 1)")                               => (exits-with 2))
+
+(facts "about --quote"
+  (rep "--quote=kakoune" "--print=value,1,echo %{value}%n" "\"it's\"")          => (prints "echo '\"it''s\"'\n")
+  (rep "--quote=shell" "--print=value,1,echo %{value}%n" "\"it's\"")            => (prints "echo '\"it'\\''s\"'\n")
+  (rep "--quote=kakoune" "--print-stream" "--print=value,1,echo %{value}%n" "\"'\"") => (prints "echo '\"''\"'\n")
+  (rep "--quote=emacs" "42")                                                  => (exits-with 2))
+
+(defn- write-jar
+  "Writes a jar to target/FILE with ENTRIES, a map of names to text, stored
+  without compression."
+  [file entries]
+  (with-open [out (java.util.zip.ZipOutputStream. (io/output-stream (io/file "target" file)))]
+    (doseq [[name text] entries
+            :let [bytes (.getBytes ^String text "UTF-8")
+                  crc (doto (java.util.zip.CRC32.) (.update bytes))]]
+      (.putNextEntry out (doto (java.util.zip.ZipEntry. ^String name)
+                           (.setMethod java.util.zip.ZipEntry/STORED)
+                           (.setSize (alength bytes))
+                           (.setCompressedSize (alength bytes))
+                           (.setCrc (.getValue crc))))
+      (.write out bytes)
+      (.closeEntry out))))
+
+(defn- sideload [path name]
+  (rep (str "--sideload=" path) "--op=rep-test-sideload" "--send=type,string,resource" (str "--send=name,string," name) "nil"))
+
+(facts "about --sideload"
+  (rep "--sideload=test" "(+ 1 1)")                           => (prints "2\n")
+  (rep "--sideload=test" "(+ 1 1)")                           => (exits-with 0)
+  (sideload "../test/sideload" "rep/greeting.txt")            => (prints "hello from the sideloader\n")
+  (sideload "../test/sideload" "rep/missing.txt")             => (prints "not found\n")
+  (sideload "../test/sideload/rep" "../rep/greeting.txt")     => (prints "not found\n")
+  (fact "it serves entries from jars"
+    (write-jar "sideload.jar" {"rep/jarred.txt" "hello from a jar"})
+    (sideload "../test/sideload:sideload.jar" "rep/jarred.txt") => (prints "hello from a jar\n")))
+
+(facts "about --supersede"
+  (rep "--supersede=core-test" "(+ 1 1)") => (prints "2\n")
+  (rep "--supersede=core-test" "(+ 1 1)") => (exits-with 0)
+  (fact "a newer evaluation with the same KEY interrupts the older one"
+    (let [[older newer] (reps-sharing-server 1000
+                          ["--supersede=core-test-interrupt" "(Thread/sleep 30000)"]
+                          ["--supersede=core-test-interrupt" "(+ 1 1)"])]
+      older => (prints "rep: the evaluation was interrupted\n" :to-stderr)
+      older => (exits-with 1)
+      newer => (prints "2\n")
+      newer => (exits-with 0))))
+
+(facts "about --tail"
+  (rep "--tail") => (prints "rep: the server does not support out-subscribe\n" :to-stderr)
+  (rep "--tail") => (exits-with 1)
+  (fact "it prints subscribed output, then unsubscribes and closes its session on SIGINT"
+    (let [result (rep-tail)]
+      result         => (prints "tailed\n")
+      result         => (exits-with 0)
+      (:ops result)  => ["out-subscribe" "out-unsubscribe" "close"]))
+  (fact "it reconnects and subscribes again after the server goes away"
+    (let [result (rep-tail :restart true)]
+      result         => (prints "tailed\ntailed\n")
+      result         => (prints #"reconnecting" :to-stderr)
+      result         => (exits-with 0)
+      (:ops result)  => ["out-subscribe" "out-subscribe" "out-unsubscribe" "close"])))
+
+(defn- gunzip [file]
+  (with-open [in (java.util.zip.GZIPInputStream. (io/input-stream file))]
+    (slurp in)))
+
+(facts "about printing to files"
+  (rep "--print=value,does-not-exist/value.txt,%{value}" "42") => (exits-with 255)
+  (rep "--print-rotate=big" "42")                              => (exits-with 2)
+  (let [dir (str (Files/createTempDirectory "rep-print" (make-array FileAttribute 0)))
+        line (apply str (repeat 99 \x))]
+    (fact "values are written to the file"
+      (rep (str "--print=value," dir "/value.txt,%{value}%n") "--print=value,1,done%n" "(+ 2 2)") => (prints "done\n")
+      (slurp (str dir "/value.txt"))                                                            => "4\n")
+    (fact "several --print options can write to one file"
+      (rep (str "--print=out," dir "/shared.txt,%{out}") (str "--print=value," dir "/shared.txt,=> %{value}%n") "(println 'hello)")
+      (slurp (str dir "/shared.txt")) => "hello\n=> nil\n")
+    (fact "a .gz file is written through gzip"
+      (rep (str "--print=value," dir "/value.txt.gz,%{value}%n") "(+ 2 2)") => (exits-with 0)
+      (gunzip (str dir "/value.txt.gz"))                                     => "4\n")
+    (fact "files are rotated once --print-rotate bytes are written"
+      (rep "--print-rotate=1k" (str "--print=out," dir "/out.log.gz,%{out}") (str "(dotimes [i 30] (println \"" line "\"))"))
+      (let [rotated (take-while #(.exists ^java.io.File %) (map #(io/file dir (str "out.log." % ".gz")) (iterate inc 1)))
+            files (concat (reverse rotated) [(io/file dir "out.log.gz")])]
+        (count rotated)                              => #(>= % 2)
+        (every? #(<= (count (gunzip %)) 1024) files) => true
+        (apply str (map gunzip files))               => (apply str (repeat 30 (str line "\n")))))))
+
+(defn- record-then-replay
+  "Records CODE to a fresh FILE, then replays FILE with ARGS."
+  [file code & args]
+  (io/delete-file (io/file "target" file) true)
+  (rep (str "--record=" file) code)
+  (apply rep (str "--replay=" file) args))
+
+(facts "about recording and replaying"
+  (rep "--record=record.rec" "(println 'hi)")                                  => (prints "hi\nnil\n")
+  (record-then-replay "replay.rec" "(println 'hi)" "(println 'hi)")            => (prints "hi\nnil\n")
+  (record-then-replay "max.rec" "(println 'hi)" "--replay-speed=max" "(+ 1 2 3)") => (prints "hi\nnil\n")
+  (fact "runs are appended, and the last one is replayed"
+    (io/delete-file "target/append.rec" true)
+    (rep "--record=append.rec" "(+ 1 1)")
+    (rep "--record=append.rec" "(+ 2 2)")
+    (rep "--replay=append.rec" "(+ 2 2)")                                      => (prints "4\n"))
+  (rep "--replay=.nrepl-port" "42")                                            => (prints "rep: not a recording made by --record\n" :to-stderr)
+  (rep "--replay=.nrepl-port" "--replay-speed=slow" "42")                      => (exits-with 2))
+
 (facts "about sending additional fields"
   (rep "--op=rep-test-op" "--send=foo,string,quux") => (prints "foo=\"quux\";\"hello\"\n")
   (rep "--op=rep-test-op" "--send=bar,integer,42")  => (prints "bar=42;\"hello\"\n"))
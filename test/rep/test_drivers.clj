@@ -17,16 +17,20 @@
              (str/replace "${user.dir}" user-dir))))))
 
 (defn rep-native-driver
-  "An integration driver which runs the `rep` binary."
+  "An integration driver which runs the `rep` binary.  With `:pipe-to`, its
+  stdout goes through that shell command."
   [server & args]
   (let [rep-bin (or (System/getenv "REP_TO_TEST")
                     "default/rep")
         starting-dir (System/getProperty "user.dir")
-        {:keys [port-file]
+        {:keys [port-file pipe-to]
          :or {port-file ".nrepl-port"}}
-        (first (filter map? args))]
+        (first (filter map? args))
+        command (if pipe-to
+                  ["sh" "-c" (str "\"$0\" \"$@\" | " pipe-to) rep-bin]
+                  [rep-bin])]
     (spit (str starting-dir "/target/" port-file) (str (:port server)))
-    (apply sh rep-bin (concat (rep-args args server starting-dir) [:dir (io/file (str starting-dir "/target"))]))))
+    (apply sh (concat command (rep-args args server starting-dir) [:dir (io/file (str starting-dir "/target"))]))))
 
 (defn- wrap-rep-test-op [f]
   (fn [{:keys [op transport] :as message}]
@@ -42,8 +46,108 @@
         (t/send transport (response-for message :status :done :value value :intvalue 67)))
       (f message))))
 
+(def ^:private sideloaders (atom {}))
+(def ^:private provided (atom {}))
+
+(defn- session-id [session]
+  (if (instance? clojure.lang.IDeref session)
+    (-> session meta :id)
+    session))
+
+(defn- wrap-rep-test-sideloader
+  "Stands in for the nREPL sideloader, which this nREPL predates.
+  `rep-test-sideload` looks up NAME of TYPE through the session's sideloader
+  and replies with its content, or with \"not found\"."
+  [f]
+  (fn [{:keys [op transport session] :as message}]
+    (case op
+      "sideloader-start"
+      (swap! sideloaders assoc (session-id session) message)
+
+      "sideloader-provide"
+      (let [{:keys [type name content]} message]
+        (when-let [p (get @provided [(session-id session) type name])]
+          (deliver p content))
+        (t/send transport (response-for message :status :done)))
+
+      "rep-test-sideload"
+      (let [{:keys [type name]} message
+            id (session-id session)
+            p (promise)]
+        (swap! provided assoc [id type name] p)
+        (loop [tries 100]
+          (when (and (pos? tries) (not (get @sideloaders id)))
+            (Thread/sleep 50)
+            (recur (dec tries))))
+        (when-let [start (get @sideloaders id)]
+          (t/send (:transport start) (response-for start :status :sideloader-lookup :type type :name name)))
+        (let [content (deref p 5000 "")]
+          (t/send transport (response-for message
+                                          :status :done
+                                          :value (if (empty? content)
+                                                   "not found"
+                                                   (String. (.decode (java.util.Base64/getDecoder) ^String content) "UTF-8"))))))
+
+      (f message))))
+
 (def ^:private handler
-  (nrepl.server/default-handler wrap-rep-test-op))
+  (nrepl.server/default-handler wrap-rep-test-op wrap-rep-test-sideloader))
+
+(def ^:private tail-ops (atom []))
+(def ^:private tail-subscribed (atom (promise)))
+
+(defn- wrap-rep-test-out-subscribe
+  "Stands in for cider-nrepl's out-subscribe, printing \"tailed\" to each
+  subscriber.  The ops which `--tail` sends are kept in `tail-ops`."
+  [f]
+  (fn [{:keys [op transport] :as message}]
+    (when (#{"out-subscribe" "out-unsubscribe" "close"} op)
+      (swap! tail-ops conj op))
+    (case op
+      "out-subscribe"
+      (do
+        (t/send transport (response-for message :status :done))
+        (t/send transport (response-for message :out "tailed\n"))
+        (deliver @tail-subscribed true))
+
+      "out-unsubscribe"
+      (t/send transport (response-for message :status :done))
+
+      (f message))))
+
+(def ^:private tail-handler
+  (nrepl.server/default-handler wrap-rep-test-op wrap-rep-test-out-subscribe))
+
+(defn- interrupt-rep []
+  (doseq [p (iterator-seq (.iterator (.children (ProcessHandle/current))))]
+    (sh "kill" "-INT" (str (.pid ^ProcessHandle p)))))
+
+(defn rep-tail
+  "Runs `rep --tail` against a server which supports out-subscribe, and
+  sends it SIGINT once it has subscribed and printed.  With `:restart`, the
+  server is first replaced by a new one on the same port, and rep has to
+  subscribe again.  Returns rep's result, with the ops it sent as `:ops`."
+  [& {:keys [restart]}]
+  (reset! tail-ops [])
+  (reset! tail-subscribed (promise))
+  (let [servers (atom [(binding [*file* nil]
+                         (nrepl.server/start-server :handler tail-handler))])
+        port (:port (first @servers))]
+    (try
+      (let [result (future (rep-native-driver (first @servers) "--tail"))]
+        (deref @tail-subscribed 10000 nil)
+        (when restart
+          (reset! tail-subscribed (promise))
+          (nrepl.server/stop-server (first @servers))
+          (swap! servers conj (binding [*file* nil]
+                                (nrepl.server/start-server :port port :handler tail-handler)))
+          (deref @tail-subscribed 30000 nil))
+        (Thread/sleep 200)
+        (interrupt-rep)
+        (assoc (deref result 10000 {:exit :timeout}) :ops @tail-ops))
+      (finally
+        (doseq [server @servers]
+          (nrepl.server/stop-server server))))))
 
 (defn rep [& args]
   (let [server (binding [*file* nil]
@@ -53,6 +157,31 @@
       (finally
         (nrepl.server/stop-server server)))))
 
+(defn with-one-server
+  "Calls F with a function which runs `rep` like `rep` does, but against the
+  same server every time, and returns what F returns."
+  [f]
+  (let [server (binding [*file* nil]
+                 (nrepl.server/start-server :handler handler))]
+    (try
+      (f (partial rep-native-driver server))
+      (finally
+        (nrepl.server/stop-server server)))))
+
+(defn reps-sharing-server
+  "Runs `rep` with each of ARGSES against one server, starting each DELAY ms
+  after the one before, and returns their results in order."
+  [delay & argses]
+  (with-one-server
+    (fn [rep]
+      (->> argses
+        (map-indexed (fn [i args]
+                       (when (pos? i)
+                         (Thread/sleep delay))
+                       (future (apply rep args))))
+        doall
+        (mapv deref)))))
+
 (defn prints [s & flags]
   (let [flags (into #{} flags)
         k (if (flags :to-stderr)